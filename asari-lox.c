@@ -1,13 +1,39 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <sysexits.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 typedef struct Token Token;
 typedef struct Node Node;
-typedef struct Value Value;
 typedef struct Entry Entry;
 typedef struct Env Env;
 
@@ -16,6 +42,8 @@ typedef enum {
   TK_RIGHT_PAREN,    // )
   TK_LEFT_BRACE,     // {
   TK_RIGHT_BRACE,    // }
+  TK_LEFT_BRACKET,   // [
+  TK_RIGHT_BRACKET,  // ]
   TK_COMMA,          // ,
   TK_DOT,            // .
   TK_MINUS,          // -
@@ -79,108 +107,588 @@ typedef enum {
   ND_AND,          // and
   ND_WHILE,        // while
   ND_NIL,          // nil
+  ND_INVARIANT,    // ループ不変な部分式（loop_tempsに値を覚える）
+  ND_INCREMENT,    // 帰納変数の更新 i = i + c
+  ND_REDUCE,       // ベクトル化した総和ループ（lhsは元のND_WHILE）
+  ND_ARRAY,        // 配列リテラル [a, b, ...]（lhsはND_ARGの並び）
+  ND_INDEX,        // a[i]
+  ND_SET_INDEX,    // a[i] = v（lhsはND_INDEX）
+  ND_CALL,         // 呼び出し（lhsが呼び出し先、rhsはND_ARGの並び）
+  ND_ARG,          // 引数・要素の並び（lhsが式、rhsが次）
+  ND_LAZY,         // まだパースしていない{}の本体（--lazy）
+  ND_FEXPR,        // 数値だけで計算できる部分式（lhsは元の式、fexprsの命令列で評価）
 } NodeKind;
 
-typedef enum {
-  VAL_NIL,     // nil
-  VAL_BOOL,    // 真偽値
-  VAL_NUM,     // 数値
-  VAL_STRING,  // 文字列
-} ValueType;
-
 struct Token {
   TokenType type;
   Token* next;
   char* lexeme;
   size_t length;
+  size_t rofs;   // 字句解析したときの、始まりからソースの終わりまでの距離（--watch）
+  uint32_t gen;  // 何回目の字句解析で作ったか（--watch）
+  int line;      // 1から数えた行番号
+};
+
+// --use-profileでノードに付ける印
+enum {
+  PGO_NUMERIC = 1,  // 演算: 何度も実行され、オペランドはいつも数値だった
+  PGO_COLD = 2,     // ND_WHILE: 何度も入るが、ほとんど回らない
+  PGO_FLIPPED = 4,  // ND_IF: 条件を反転して本体を入れ替えた
 };
 
+// 種類ごとに使わないフィールドは共用体で重ね、1ノードを56バイトに収める。
+// ノードはnode_poolからまとめて切り出すので、パースした順に隣り合って並ぶ。
 struct Node {
   NodeKind kind;
+  // ND_INVARIANT: loop_tempsの添字, ND_WHILE: 最初の添字, ND_FEXPR: fexprsの添字,
+  // ND_IDENTIFIER/ND_ASSIGN/ND_DECLARATION/ND_INCREMENT: 型推論での束縛の番号
+  int slot;
   Node* lhs;
   Node* rhs;
   Node* next;
-  Node* alt;
-  double val;
-  char* sval;
-  bool bval;
-};
-
-struct Value {
-  ValueType type;
   union {
-    double num;
-    bool boolean;
-    char* str;
+    double val;    // ND_NUM, ND_INCREMENT
+    Token* start;  // ND_LAZY: 本体の{のトークン
+  };
+  union {
+    Node* alt;   // ND_IF
+    char* sval;  // ND_STR, ND_IDENTIFIER, ND_DECLARATION, ND_INCREMENT
   };
+  bool bval;    // ND_BOOL, ND_INCREMENT, ND_LT/ND_LE: 右辺から評価する（元は > / >=）
+  bool consed;  // ハッシュコンスの表に入っている
+  bool shared;  // 2か所以上から参照されている（最適化で子を書き換えない）
+  uint8_t pgo;  // PGO_*の組み合わせ（--use-profile）
+  int line;     // 1から数えた行番号（--sample-profile）
+};
+
+// --- 実行統計（--stats） ---
+// カウンタは常に数えておき、--statsが指定されていれば終了時にstderrへ出す。
+
+typedef enum {
+  PHASE_SCAN,   // scanTokens
+  PHASE_PARSE,  // program
+  PHASE_OPT,    // optimize_loops
+  PHASE_EVAL,   // eval
+  PHASE_COUNT,
+} Phase;
+
+typedef enum {
+  ALLOC_TOKEN,   // addToken
+  ALLOC_NODE,    // new_node*
+  ALLOC_ENV,     // env_push
+  ALLOC_ENTRY,   // env_define
+  ALLOC_CONCAT,  // 文字列の連結
+  ALLOC_ARRAY,   // 配列
+  ALLOC_CODE,    // --single-passの命令列と定数
+  ALLOC_INPUT,   // 標準入力の読み込みブロック
+  ALLOC_SITE_COUNT,
+} AllocSite;
+
+typedef enum {
+  STATS_OFF,
+  STATS_TEXT,
+  STATS_JSON,
+} StatsMode;
+
+typedef struct {
+  double wall[PHASE_COUNT];  // 秒
+  double cpu[PHASE_COUNT];   // 秒
+  size_t tokens;
+  size_t nodes;
+  size_t consed;  // ハッシュコンスで既存のノードを使い回した回数
+  size_t dead_decls;   // 消した宣言
+  size_t dead_stores;  // 消した代入
+  size_t profile_matched;     // プロファイルと照らし合わせられたサイト
+  size_t profile_speculated;  // 変数を確かめる数値の命令列にした式
+  size_t profile_deopts;      // 確かめに失敗して元の木で評価し直した回数
+  size_t alloc_calls[ALLOC_SITE_COUNT];
+  size_t alloc_bytes[ALLOC_SITE_COUNT];
+  size_t env_probes;  // env_findで比較したエントリ数
+  size_t get_calls;
+  size_t get_depth;  // 辿ったスコープの数
+  size_t get_probes;
+  size_t assign_calls;
+  size_t assign_depth;
+  size_t assign_probes;
+  size_t lazy_deferred;  // --lazyで読み飛ばした本体
+  size_t lazy_parsed;    // そのうち実行時にパースしたもの
+} Stats;
+
+static const char* phase_names[PHASE_COUNT] = {"scan", "parse", "optimize",
+                                                  "eval"};
+static const char* alloc_site_names[ALLOC_SITE_COUNT] = {
+    "addToken", "new_node", "env_push", "env_define", "concat",
+    "array", "chunk", "read_line"};
+
+static StatsMode stats_mode = STATS_OFF;
+static Stats stats;
+
+// --statsのときだけ数える。変数の検索のように頻繁に通る所で、使わないカウンタに書き込まない
+#define STAT(expr)        \
+  do {                    \
+    if (stats_mode) expr; \
+  } while (0)
+
+// forkした子（--shards・--serve・--watch）は、親がatexitで登録した報告も引き継ぐ。
+// 子がexitで報告すると親の分と重なるので、子ではこれを立てて報告しない
+static bool forked_child = false;
+static struct timespec phase_wall_start[PHASE_COUNT];
+static struct timespec phase_cpu_start[PHASE_COUNT];
+
+static double elapsed(struct timespec from, struct timespec to) {
+  return (double)(to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+// --- ハードウェアカウンタ（--perf-counters） ---
+// perf_event_openでサイクル・命令・分岐予測ミス・L1d/LLCのミス・ページフォールトを
+// 開いておき、phase_begin/phase_endで読んだ差をフェーズごとに足し込む。
+// カウンタが多重化されたときは、有効だった時間と実際に数えた時間の比で補正する。
+// 開けなかったカウンタ（権限やコンテナ、仮想化の制限）は「n/a」と表示して続ける。
+
+typedef enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_PAGE_FAULTS,
+  PERF_COUNT,
+} PerfCounter;
+
+static const char* perf_names[PERF_COUNT] = {
+    "cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses",
+    "page-faults"};
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} perf_events[PERF_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
 };
 
+static bool perf_enabled = false;
+static int perf_fds[PERF_COUNT];
+static double perf_start[PHASE_COUNT][PERF_COUNT];
+static double perf_phase[PHASE_COUNT][PERF_COUNT];
+
+static void perf_open() {
+  perf_enabled = true;
+  for (int i = 0; i < PERF_COUNT; ++i) {
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = perf_events[i].type,
+        .config = perf_events[i].config,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+        .read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+    };
+    perf_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+// 補正した値。読めなければ負
+static double perf_read(int i) {
+  uint64_t buf[3];
+  if (perf_fds[i] < 0 || read(perf_fds[i], buf, sizeof(buf)) != sizeof(buf)) {
+    return -1;
+  }
+  if (buf[2] == 0) return 0;
+  return (double)buf[0] * ((double)buf[1] / (double)buf[2]);
+}
+
+static void perf_report() {
+  if (forked_child) return;
+  fflush(stdout);
+  double total[PERF_COUNT];
+  int available = 0;
+  for (int i = 0; i < PERF_COUNT; ++i) {
+    total[i] = perf_read(i);
+    if (total[i] >= 0) available++;
+  }
+  if (available == 0) {
+    fprintf(stderr, "--perf-counters: カウンタを開けませんでした"
+                    "（perf_event_paranoidや実行環境の制限を確認してください）。\n");
+    return;
+  }
+
+  fprintf(stderr, "--- perf counters ---\n");
+  fprintf(stderr, "%-14s", "counter");
+  for (int p = 0; p < PHASE_COUNT; ++p) fprintf(stderr, " %14s", phase_names[p]);
+  fprintf(stderr, " %14s\n", "total");
+  for (int i = 0; i < PERF_COUNT; ++i) {
+    fprintf(stderr, "%-14s", perf_names[i]);
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+      if (total[i] < 0) {
+        fprintf(stderr, " %14s", "n/a");
+      } else {
+        fprintf(stderr, " %14.0f", perf_phase[p][i]);
+      }
+    }
+    if (total[i] < 0) {
+      fprintf(stderr, " %14s\n", "n/a");
+    } else {
+      fprintf(stderr, " %14.0f\n", total[i]);
+    }
+  }
+  if (total[PERF_CYCLES] > 0 && total[PERF_INSTRUCTIONS] >= 0) {
+    fprintf(stderr, "%-14s", "IPC");
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+      double c = perf_phase[p][PERF_CYCLES];
+      fprintf(stderr, " %14.3f", c > 0 ? perf_phase[p][PERF_INSTRUCTIONS] / c : 0.0);
+    }
+    fprintf(stderr, " %14.3f\n", total[PERF_INSTRUCTIONS] / total[PERF_CYCLES]);
+  }
+}
+
+static void phase_begin(Phase phase) {
+  clock_gettime(CLOCK_MONOTONIC, &phase_wall_start[phase]);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &phase_cpu_start[phase]);
+  if (perf_enabled) {
+    for (int i = 0; i < PERF_COUNT; ++i) perf_start[phase][i] = perf_read(i);
+  }
+}
+
+static void phase_end(Phase phase) {
+  struct timespec wall, cpu;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  stats.wall[phase] += elapsed(phase_wall_start[phase], wall);
+  stats.cpu[phase] += elapsed(phase_cpu_start[phase], cpu);
+  if (perf_enabled) {
+    for (int i = 0; i < PERF_COUNT; ++i) {
+      double v = perf_read(i);
+      if (v >= 0) perf_phase[phase][i] += v - perf_start[phase][i];
+    }
+  }
+}
+
+static void stats_alloc(AllocSite site, size_t bytes) {
+  if (!stats_mode) return;
+  stats.alloc_calls[site]++;
+  stats.alloc_bytes[site] += bytes;
+}
+
+static double ratio(size_t n, size_t d) { return d ? (double)n / d : 0.0; }
+
+static void stats_report() {
+  if (forked_child) return;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  fflush(stdout);
+
+  if (stats_mode == STATS_JSON) {
+    fprintf(stderr, "{\"phases\": {");
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+      fprintf(stderr, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+              i ? ", " : "", phase_names[i], stats.wall[i] * 1e3,
+              stats.cpu[i] * 1e3);
+    }
+    fprintf(stderr, "}, \"tokens\": %zu, \"nodes\": %zu, ", stats.tokens,
+            stats.nodes);
+    fprintf(stderr, "\"consed\": {\"hits\": %zu, \"bytes_saved\": %zu}, ",
+            stats.consed, stats.consed * sizeof(Node));
+    fprintf(stderr, "\"dead\": {\"declarations\": %zu, \"stores\": %zu}, ",
+            stats.dead_decls, stats.dead_stores);
+    fprintf(stderr, "\"allocations\": {");
+    for (int i = 0; i < ALLOC_SITE_COUNT; ++i) {
+      fprintf(stderr, "%s\"%s\": {\"calls\": %zu, \"bytes\": %zu}", i ? ", " : "",
+              alloc_site_names[i], stats.alloc_calls[i], stats.alloc_bytes[i]);
+    }
+    fprintf(stderr, "}, \"peak_rss_kb\": %ld, \"env\": {", ru.ru_maxrss);
+    fprintf(stderr,
+            "\"get\": {\"calls\": %zu, \"avg_depth\": %.3f, \"avg_compares\": %.3f}, ",
+            stats.get_calls, ratio(stats.get_depth, stats.get_calls),
+            ratio(stats.get_probes, stats.get_calls));
+    fprintf(stderr,
+            "\"assign\": {\"calls\": %zu, \"avg_depth\": %.3f, \"avg_compares\": %.3f}",
+            stats.assign_calls, ratio(stats.assign_depth, stats.assign_calls),
+            ratio(stats.assign_probes, stats.assign_calls));
+    fprintf(stderr, "}, \"lazy\": {\"deferred\": %zu, \"parsed\": %zu}, ",
+            stats.lazy_deferred, stats.lazy_parsed);
+    fprintf(stderr,
+            "\"profile\": {\"matched\": %zu, \"speculated\": %zu, \"deopts\": %zu}}\n",
+            stats.profile_matched, stats.profile_speculated, stats.profile_deopts);
+    return;
+  }
+
+  fprintf(stderr, "--- stats ---\n");
+  fprintf(stderr, "%-12s %12s %12s\n", "phase", "wall(ms)", "cpu(ms)");
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    fprintf(stderr, "%-12s %12.3f %12.3f\n", phase_names[i], stats.wall[i] * 1e3,
+            stats.cpu[i] * 1e3);
+  }
+  fprintf(stderr, "tokens: %zu\n", stats.tokens);
+  fprintf(stderr, "nodes: %zu\n", stats.nodes);
+  fprintf(stderr, "hash-consed: %zu hits, %zu bytes saved\n", stats.consed,
+          stats.consed * sizeof(Node));
+  fprintf(stderr, "dead code: %zu declarations, %zu stores removed\n",
+          stats.dead_decls, stats.dead_stores);
+  if (stats.lazy_deferred) {
+    fprintf(stderr, "lazy bodies: %zu deferred, %zu parsed\n",
+            stats.lazy_deferred, stats.lazy_parsed);
+  }
+  if (stats.profile_matched) {
+    fprintf(stderr, "profile: %zu sites matched, %zu speculated, %zu deopts\n",
+            stats.profile_matched, stats.profile_speculated, stats.profile_deopts);
+  }
+  fprintf(stderr, "%-12s %12s %12s\n", "alloc site", "calls", "bytes");
+  for (int i = 0; i < ALLOC_SITE_COUNT; ++i) {
+    fprintf(stderr, "%-12s %12zu %12zu\n", alloc_site_names[i],
+            stats.alloc_calls[i], stats.alloc_bytes[i]);
+  }
+  fprintf(stderr, "peak rss: %ld KB\n", ru.ru_maxrss);
+  fprintf(stderr, "env_get: %zu calls, avg depth %.3f, avg compares %.3f\n",
+          stats.get_calls, ratio(stats.get_depth, stats.get_calls),
+          ratio(stats.get_probes, stats.get_calls));
+  fprintf(stderr, "env_assign: %zu calls, avg depth %.3f, avg compares %.3f\n",
+          stats.assign_calls, ratio(stats.assign_depth, stats.assign_calls),
+          ratio(stats.assign_probes, stats.assign_calls));
+}
+
+Token head;
+
+// 評価できるノード数の残り。ループの後方分岐で0以下ならtask_yieldする（--green）。
+static long budget_left = LONG_MAX;
+
+static void task_yield();
+
+// 値と、その演算・組み込み関数（--emit-cで書き出すCと共有する）
+#include "asari-runtime.h"
+
+// 標準入力の行が入ったブロックを、変数から指されている数で管理する（標準入力の行読み）
+static void line_ref(Value v, int delta);
+// 字句解析した(の数。1つの式の評価で起こる呼び出しは、これより多くならない
+static size_t paren_count = 0;
+
 struct Entry {
-  char* key;
+  char* key;  // NULLなら空きスロット
+  uint32_t hash;
   Value value;
-  Entry* next;
 };
 
+// 変数が少ないうちはentriesを先頭から詰めて線形に探し、
+// ENV_SMALL_MAXを超えたらオープンアドレス法（線形探査）のハッシュ表に切り替える。
 struct Env {
-  Entry* head;
+  Entry* entries;
+  size_t count;
+  size_t capacity;
   Env* enclosing;
+  bool mapped;  // entriesがスナップショットの領域を指している（freeしない）
 };
 
-Token head;
+#define ENV_SMALL_MAX 8
+
 
 Env global = {0};
 Env* current_env = &global;
 
+// FNV-1a
+static uint32_t hash_string(const char* key) {
+  uint32_t hash = 2166136261u;
+  for (const char* p = key; *p; ++p) {
+    hash ^= (unsigned char)*p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static Entry* env_find(Env* env, const char* key, uint32_t hash) {
+  if (env->capacity <= ENV_SMALL_MAX) {
+    for (size_t i = 0; i < env->count; ++i) {
+      Entry* e = &env->entries[i];
+      STAT(stats.env_probes++);
+      if (e->hash == hash && strcmp(e->key, key) == 0) return e;
+    }
+    return NULL;
+  }
+
+  size_t mask = env->capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    Entry* e = &env->entries[i];
+    if (e->key == NULL) return NULL;
+    STAT(stats.env_probes++);
+    if (e->hash == hash && strcmp(e->key, key) == 0) return e;
+  }
+}
+
+// ハッシュ表としてcapacity個のスロットを確保し直し、今ある変数を入れ直す
+static void env_rehash(Env* env, size_t capacity) {
+  Entry* old = env->entries;
+  size_t old_capacity = env->capacity;
+  size_t old_count = env->count;
+  bool was_small = old_capacity <= ENV_SMALL_MAX;
+
+  env->entries = (Entry*)calloc(capacity, sizeof(Entry));
+  stats_alloc(ALLOC_ENTRY, capacity * sizeof(Entry));
+  if (!env->entries) {
+    fprintf(stderr, "メモリ確保に失敗しました。\n");
+    exit(74);
+  }
+  env->capacity = capacity;
+
+  size_t n = was_small ? old_count : old_capacity;
+  for (size_t i = 0; i < n; ++i) {
+    if (old[i].key == NULL) continue;
+    size_t j = old[i].hash & (capacity - 1);
+    while (env->entries[j].key != NULL) j = (j + 1) & (capacity - 1);
+    env->entries[j] = old[i];
+  }
+  if (!env->mapped) free(old);
+  env->mapped = false;
+}
+
+static Entry* env_insert(Env* env, char* key, uint32_t hash) {
+  if (env->capacity <= ENV_SMALL_MAX) {
+    if (env->count < ENV_SMALL_MAX) {
+      if (env->count == env->capacity) {
+        env->capacity = env->capacity ? env->capacity * 2 : 2;
+        env->entries = realloc(env->entries, env->capacity * sizeof(Entry));
+        stats_alloc(ALLOC_ENTRY, env->capacity * sizeof(Entry));
+        if (!env->entries) {
+          fprintf(stderr, "メモリ確保に失敗しました。\n");
+          exit(74);
+        }
+      }
+      Entry* e = &env->entries[env->count++];
+      e->key = key;
+      e->hash = hash;
+      return e;
+    }
+    env_rehash(env, ENV_SMALL_MAX * 4);
+  } else if ((env->count + 1) * 4 > env->capacity * 3) {
+    env_rehash(env, env->capacity * 2);
+  }
+
+  size_t mask = env->capacity - 1;
+  size_t i = hash & mask;
+  while (env->entries[i].key != NULL) i = (i + 1) & mask;
+  Entry* e = &env->entries[i];
+  e->key = key;
+  e->hash = hash;
+  env->count++;
+  return e;
+}
+
 Env* env_push(Env* enclosing) {
   Env* e = (Env*)calloc(1, sizeof(Env));
+  stats_alloc(ALLOC_ENV, sizeof(Env));
 
   e->enclosing = enclosing;
   return e;
 }
 
-Env* env_pop(Env* e) { return e->enclosing; }
+// ブロックのスコープは抜けたら二度と参照されないので、ここで解放する
+Env* env_pop(Env* e) {
+  Env* enclosing = e->enclosing;
+  size_t n = e->capacity <= ENV_SMALL_MAX ? e->count : e->capacity;
+  for (size_t i = 0; i < n; ++i) {
+    if (e->entries[i].key) line_ref(e->entries[i].value, -1);
+    free(e->entries[i].key);
+  }
+  free(e->entries);
+  free(e);
+  return enclosing;
+}
 
 void env_define(Env* env, char* key, Value v) {
-  Entry* e = (Entry*)calloc(1, sizeof(Entry));
-  e->key = (char*)calloc(strlen(key) + 1, sizeof(char));
-  strcpy(e->key, key);
+  uint32_t hash = hash_string(key);
+  Entry* e = env_find(env, key, hash);
+  if (e == NULL) {
+    char* copy = (char*)calloc(strlen(key) + 1, sizeof(char));
+    stats_alloc(ALLOC_ENTRY, strlen(key) + 1);
+    strcpy(copy, key);
+    e = env_insert(env, copy, hash);
+  } else {
+    line_ref(e->value, -1);
+  }
+  line_ref(v, 1);
   e->value = v;
-  e->next = env->head;
-  env->head = e;
 }
 
 bool env_assign(Env* env, char* key, Value v) {
+  uint32_t hash = hash_string(key);
+  size_t probes = stats.env_probes;
+  STAT(stats.assign_calls++);
   for (Env* env_ptr = env; env_ptr != NULL; env_ptr = env_ptr->enclosing) {
-    for (Entry* e = env_ptr->head; e != NULL; e = e->next) {
-      if (strlen(e->key) == strlen(key) && strcmp(e->key, key) == 0) {
-        e->value = v;
-        return true;
-      }
+    STAT(stats.assign_depth++);
+    Entry* e = env_find(env_ptr, key, hash);
+    if (e != NULL) {
+      STAT(stats.assign_probes += stats.env_probes - probes);
+      line_ref(e->value, -1);
+      line_ref(v, 1);
+      e->value = v;
+      return true;
     }
   }
+  STAT(stats.assign_probes += stats.env_probes - probes);
   return false;
 }
 
-Value env_get(Env* env, char* key) {
+// hashは名前のhash_string。型推論で数値と分かった式は、前もって計算しておいたものを渡す
+Value env_get_hash(Env* env, char* key, uint32_t hash) {
+  size_t probes = stats.env_probes;
+  STAT(stats.get_calls++);
   for (Env* env_ptr = env; env_ptr != NULL; env_ptr = env_ptr->enclosing) {
-    for (Entry* e = env_ptr->head; e != NULL; e = e->next) {
-      if (strlen(e->key) == strlen(key) && strcmp(e->key, key) == 0) {
-        return e->value;
-      }
+    STAT(stats.get_depth++);
+    Entry* e = env_find(env_ptr, key, hash);
+    if (e != NULL) {
+      STAT(stats.get_probes += stats.env_probes - probes);
+      return e->value;
     }
   }
   fprintf(stderr, "未定義の変数: %s\n", key);
-  exit(EX_DATAERR);
+  fail(EX_DATAERR);
+}
+
+// 読んですぐ書き戻す場合に、変数のエントリを一度の検索で得る
+Entry* env_lookup_hash(Env* env, char* key, uint32_t hash) {
+  size_t probes = stats.env_probes;
+  STAT(stats.assign_calls++);
+  for (Env* env_ptr = env; env_ptr != NULL; env_ptr = env_ptr->enclosing) {
+    STAT(stats.assign_depth++);
+    Entry* e = env_find(env_ptr, key, hash);
+    if (e != NULL) {
+      STAT(stats.assign_probes += stats.env_probes - probes);
+      return e;
+    }
+  }
+  STAT(stats.assign_probes += stats.env_probes - probes);
+  return NULL;
+}
+
+Value env_get(Env* env, char* key) { return env_get_hash(env, key, hash_string(key)); }
+
+Entry* env_lookup(Env* env, char* key) {
+  return env_lookup_hash(env, key, hash_string(key));
 }
 
+static char* scan_end;     // 字句解析中のソースの終わり
+static uint32_t scan_gen;  // 字句解析の回数（--watch）
+static unsigned long scan_line;  // 字句解析中の行（0から数える）
+
 Token* addToken(Token* pos, TokenType type, char* start, size_t len) {
   Token* token = (Token*)calloc(1, sizeof(Token));
   token->type = type;
   token->next = NULL;
   token->length = len;
+  token->rofs = start ? (size_t)(scan_end - start) : 0;
+  token->gen = scan_gen;
+  token->line = (int)scan_line + 1;
   token->lexeme = calloc(len + 1, sizeof(char));
   memcpy(token->lexeme, start, len);
   token->lexeme[len] = '\0';
+  stats.tokens++;
+  stats_alloc(ALLOC_TOKEN, sizeof(Token) + len + 1);
   pos->next = token;
   return token;
 }
@@ -189,21 +697,163 @@ static void report(int line, char* where, char* message) {
   fprintf(stderr, "[line %d] Error %s: %s\n", line, where, message);
 }
 
+// lineはトークンと同じく1から数える
 static void error(int line, char* message) {
   report(line, "", message);
   exit(EX_DATAERR);
 }
 
-void scanTokens(char* source) {
-  Token* pos = &head;
-  head.next = NULL;
+// --- スキャナの内側ループ（SIMD） ---
+// 空白・コメント・文字列・識別子・数値の連続部分を16〜32バイト単位で読み飛ばす。
+// どの関数も'\0'で必ず止まり、読み飛ばした範囲の改行をlineに加算する。
+// SIMD版はアラインされたロードしか行わないため、'\0'の先を読んでも
+// ページ境界を越えることはない。
+typedef struct {
+  char* (*skip_space)(char* p, unsigned long* line);
+  char* (*skip_comment)(char* p);
+  char* (*skip_string)(char* p, unsigned long* line);
+  char* (*skip_alpha)(char* p);
+  char* (*skip_digit)(char* p);
+} ScanKernels;
+
+static char* scalar_skip_space(char* p, unsigned long* line) {
+  while (isspace((unsigned char)*p)) {
+    if (*p == '\n') ++*line;
+    ++p;
+  }
+  return p;
+}
 
-  char* p = source;
-  unsigned long line = 0;
+static char* scalar_skip_comment(char* p) {
+  while (*p != '\n' && *p != '\0') ++p;
+  return p;
+}
+
+static char* scalar_skip_string(char* p, unsigned long* line) {
+  while (*p != '\"' && *p != '\0') {
+    if (*p == '\n') ++*line;
+    ++p;
+  }
+  return p;
+}
+
+static char* scalar_skip_alpha(char* p) {
+  while (isalpha((unsigned char)*p)) ++p;
+  return p;
+}
+
+static char* scalar_skip_digit(char* p) {
+  while (isdigit((unsigned char)*p)) ++p;
+  return p;
+}
+
+#if defined(__x86_64__)
+// 各ブロックで「止まるべきバイト」のマスクを作り、最初に立っているビットを探す。
+// offは先頭ブロックでpより前にあるバイトを無視するためのもの。
+#define DEFINE_SIMD_SCAN(ISA, VEC, WIDTH, LOAD, SET1, CMPEQ, CMPGT, OR, AND, \
+                         MOVEMASK)                                           \
+  static inline VEC ISA##_in_range(VEC v, char lo, char hi) {               \
+    return AND(CMPGT(v, SET1(lo - 1)), CMPGT(SET1(hi + 1), v));             \
+  }                                                                         \
+                                                                            \
+  static inline uint32_t ISA##_stop_mask(int kind, VEC v) {                 \
+    switch (kind) {                                                         \
+      case 0: /* 空白以外 */                                                \
+        return ~(uint32_t)MOVEMASK(                                         \
+            OR(CMPEQ(v, SET1(' ')), ISA##_in_range(v, '\t', '\r')));        \
+      case 1: /* 改行か終端 */                                              \
+        return (uint32_t)MOVEMASK(                                          \
+            OR(CMPEQ(v, SET1('\n')), CMPEQ(v, SET1('\0'))));                \
+      case 2: /* 引用符か終端 */                                            \
+        return (uint32_t)MOVEMASK(                                          \
+            OR(CMPEQ(v, SET1('\"')), CMPEQ(v, SET1('\0'))));                \
+      case 3: /* 英字以外 */                                                \
+        return ~(uint32_t)MOVEMASK(                                         \
+            ISA##_in_range(OR(v, SET1(0x20)), 'a', 'z'));                   \
+      default: /* 数字以外 */                                               \
+        return ~(uint32_t)MOVEMASK(ISA##_in_range(v, '0', '9'));            \
+    }                                                                       \
+  }                                                                         \
+                                                                            \
+  static inline char* ISA##_scan(int kind, char* p, unsigned long* line) {  \
+    uintptr_t off = (uintptr_t)p % WIDTH;                                   \
+    char* b = p - off;                                                      \
+    uint32_t full = (uint32_t)(((uint64_t)1 << WIDTH) - 1);                 \
+    uint32_t valid = (full << off) & full;                                  \
+    for (;;) {                                                              \
+      VEC v = LOAD((const VEC*)b);                                          \
+      uint32_t stop = ISA##_stop_mask(kind, v) & valid;                     \
+      uint32_t counted = valid;                                             \
+      if (stop) counted &= (stop & -stop) - 1;                              \
+      if (line) {                                                           \
+        *line += __builtin_popcount(                                        \
+            (uint32_t)MOVEMASK(CMPEQ(v, SET1('\n'))) & counted);            \
+      }                                                                     \
+      if (stop) return b + __builtin_ctz(stop);                             \
+      b += WIDTH;                                                           \
+      valid = full;                                                         \
+    }                                                                       \
+  }                                                                         \
+                                                                            \
+  static char* ISA##_skip_space(char* p, unsigned long* line) {             \
+    return ISA##_scan(0, p, line);                                          \
+  }                                                                         \
+  static char* ISA##_skip_comment(char* p) { return ISA##_scan(1, p, NULL); } \
+  static char* ISA##_skip_string(char* p, unsigned long* line) {            \
+    return ISA##_scan(2, p, line);                                          \
+  }                                                                         \
+  static char* ISA##_skip_alpha(char* p) { return ISA##_scan(3, p, NULL); } \
+  static char* ISA##_skip_digit(char* p) { return ISA##_scan(4, p, NULL); }
+
+DEFINE_SIMD_SCAN(sse2, __m128i, 16, _mm_load_si128, _mm_set1_epi8,
+                 _mm_cmpeq_epi8, _mm_cmpgt_epi8, _mm_or_si128, _mm_and_si128,
+                 _mm_movemask_epi8)
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+DEFINE_SIMD_SCAN(avx2, __m256i, 32, _mm256_load_si256, _mm256_set1_epi8,
+                 _mm256_cmpeq_epi8, _mm256_cmpgt_epi8, _mm256_or_si256,
+                 _mm256_and_si256, _mm256_movemask_epi8)
+#pragma GCC pop_options
+#endif
+
+static ScanKernels scan = {
+    scalar_skip_space, scalar_skip_comment, scalar_skip_string,
+    scalar_skip_alpha, scalar_skip_digit,
+};
+
+// 実行中のCPUに合わせてscanの中身を選ぶ。ASARI_NO_SIMDが設定されていればスカラー版のまま。
+static void scan_init() {
+  static bool initialized = false;
+  if (initialized) return;
+  initialized = true;
+
+  if (getenv("ASARI_NO_SIMD")) return;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan = (ScanKernels){avx2_skip_space, avx2_skip_comment, avx2_skip_string,
+                         avx2_skip_alpha, avx2_skip_digit};
+  } else {
+    scan = (ScanKernels){sse2_skip_space, sse2_skip_comment, sse2_skip_string,
+                         sse2_skip_alpha, sse2_skip_digit};
+  }
+#endif
+}
+
+// pから字句解析して*posの後ろにつなぐ。lineはpのある行（0から数える）。
+// stopがあれば、トークンの間でstop(rofs)が真になった位置で止める。
+// 止まった位置（最後まで読んだら終端）を返し、scan_lineはその位置の行になる。
+static char* scan_from(char* p, unsigned long line, Token** pos_inout,
+                       bool (*stop)(size_t rofs)) {
+  Token* pos = *pos_inout;
+  scan_init();
+
+  scan_line = line;
   while (*p) {
-    if (isspace(*p)) {
-      if (*p == '\n') ++line;
-      ++p;
+    if (stop && stop((size_t)(scan_end - p))) break;
+    if (isspace((unsigned char)*p)) {
+      p = scan.skip_space(p, &scan_line);
       continue;
     }
     char* start;
@@ -211,6 +861,7 @@ void scanTokens(char* source) {
     switch (*p) {
       case '(':
         pos = addToken(pos, TK_LEFT_PAREN, p, 1);
+        paren_count++;
         ++p;
         break;
 
@@ -226,6 +877,14 @@ void scanTokens(char* source) {
         pos = addToken(pos, TK_RIGHT_BRACE, p, 1);
         ++p;
         break;
+      case '[':
+        pos = addToken(pos, TK_LEFT_BRACKET, p, 1);
+        ++p;
+        break;
+      case ']':
+        pos = addToken(pos, TK_RIGHT_BRACKET, p, 1);
+        ++p;
+        break;
       case ',':
         pos = addToken(pos, TK_COMMA, p, 1);
         ++p;
@@ -288,9 +947,7 @@ void scanTokens(char* source) {
         break;
       case '/':
         if (*(p + 1) == '/') {
-          while (*p != '\n' && *p != '\0') {
-            ++p;
-          }
+          p = scan.skip_comment(p);
         } else {
           pos = addToken(pos, TK_SLASH, p, 1);
           ++p;
@@ -298,12 +955,9 @@ void scanTokens(char* source) {
         break;
       case '\"':
         start = ++p;
-        while (*p != '\"' && *p != '\0') {
-          if (*p == '\n') line++;
-          ++p;
-        }
+        p = scan.skip_string(p, &scan_line);
         if (*p == '\0') {
-          error(line, "文字列が終結していません。");
+          error(scan_line + 1, "文字列が終結していません。");
         }
         pos = addToken(pos, TK_STRING, start, (size_t)(p - start));
         ++p;
@@ -312,15 +966,11 @@ void scanTokens(char* source) {
         start = p;
         // 数値トークン
         if (isdigit(*p)) {
-          while (isdigit(*p)) {
-            ++p;
-          }
+          p = scan.skip_digit(p);
 
           if (*p == '.' && isdigit(*(p + 1))) {
             ++p;
-            while (isdigit(*p)) {
-              ++p;
-            }
+            p = scan.skip_digit(p);
           }
 
           pos = addToken(pos, TK_NUMBER, start, (size_t)(p - start));
@@ -328,7 +978,7 @@ void scanTokens(char* source) {
         }
         // 識別子
         else if (isalpha(*p)) {
-          while (isalpha(*p)) ++p;
+          p = scan.skip_alpha(p);
 
           if ((strlen("and") == p - start) &&
               strncmp(start, "and", p - start) == 0) {
@@ -432,48 +1082,227 @@ void scanTokens(char* source) {
           }
         }
 
-        error(line, "定義されていないトークンです");
+        error(scan_line + 1, "定義されていないトークンです");
         break;
     }
   }
+  *pos_inout = pos;
+  return p;
+}
+
+void scanTokens(char* source) {
+  Token* pos = &head;
+  head.next = NULL;
+  scan_end = source + strlen(source);
+  scan_from(source, 0, &pos, NULL);
   addToken(pos, TK_EOF, NULL, 0);
 }
 
+// ノードは個別にfreeしないので、NODE_POOL_SIZE個ずつまとめて確保して順に使う
+#define NODE_POOL_SIZE 4096
+
+static Node* node_pool;
+static size_t node_pool_left;
+
+Token* token;  // パース中のトークン
+
 Node* new_node(NodeKind kind, Node* lhs, Node* rhs) {
-  Node* node = (Node*)calloc(1, sizeof(Node));
+  if (node_pool_left == 0) {
+    node_pool = (Node*)calloc(NODE_POOL_SIZE, sizeof(Node));
+    if (!node_pool) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+    node_pool_left = NODE_POOL_SIZE;
+    stats_alloc(ALLOC_NODE, NODE_POOL_SIZE * sizeof(Node));
+  }
+  Node* node = node_pool++;
+  node_pool_left--;
+  stats.nodes++;
   node->kind = kind;
   node->lhs = lhs;
   node->rhs = rhs;
+  // 演算子や文は左の子（最初の文）の行、葉はいま読んでいるトークンの行にする。
+  // ハッシュコンスで共有した子は最初に現れた行を持っているので使わない
+  if (lhs && !lhs->shared) {
+    node->line = lhs->line;
+  } else if (rhs && !rhs->shared) {
+    node->line = rhs->line;
+  } else {
+    node->line = token ? token->line : 0;
+  }
   return node;
 }
 
 Node* new_node_num(double val) {
-  Node* node = calloc(1, sizeof(Node));
-  node->kind = ND_NUM;
+  Node* node = new_node(ND_NUM, NULL, NULL);
   node->val = val;
   return node;
 }
 
 Node* new_node_str(char* val) {
-  Node* node = calloc(1, sizeof(Node));
-  node->kind = ND_STR;
+  Node* node = new_node(ND_STR, NULL, NULL);
   node->sval = val;
   return node;
 }
 
 Node* new_node_bool(bool val) {
-  Node* node = calloc(1, sizeof(Node));
-  node->kind = ND_BOOL;
+  Node* node = new_node(ND_BOOL, NULL, NULL);
   node->bval = val;
   return node;
 }
 
-Node* new_node_nil() {
-  Node* node = calloc(1, sizeof(Node));
-  node->kind = ND_NIL;
+Node* new_node_nil() { return new_node(ND_NIL, NULL, NULL); }
+
+// --- ハッシュコンス ---
+// リテラル・識別子と、それらだけからなる副作用のない演算子の木は、同じ形のものを
+// 1つのノードにまとめる。子は既にまとめてあるので、比較は種類・値・子のポインタで済む。
+// 生成されたスクリプトのように同じ式が何千回も現れる場合にASTが小さくなる。
+// 共有されたノード（shared）の子は、ループ不変式や数値式で包む最適化で書き換えない。
+// 子を書き換えたノードはもう表の中身と一致しないので、後から共有されることはない。
+// 識別子は場所によって別の変数を指しうるので、型推論は共有された識別子の束縛を
+// 使われた場所ごとに照合し、食い違えば型不明にする。
+
+#define BINDING_UNRESOLVED (-2)  // 型推論がまだ束縛を決めていない
+
+// > / >= から作った比較。右辺（ソースでは左にあった式）を先に評価する
+static bool is_swapped(Node* node) {
+  return (node->kind == ND_LT || node->kind == ND_LE) && node->bval;
+}
+
+static Node** cons_table;
+static size_t cons_cap;
+static size_t cons_count;
+
+static bool consable(NodeKind kind) {
+  switch (kind) {
+    case ND_NUM:
+    case ND_STR:
+    case ND_BOOL:
+    case ND_NIL:
+    case ND_IDENTIFIER:
+    case ND_ADD:
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_NEG:
+    case ND_BANG:
+    case ND_LT:
+    case ND_LE:
+    case ND_EQ:
+    case ND_NE:
+    case ND_AND:
+    case ND_OR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static uint32_t cons_hash(Node* node) {
+  uint64_t h = (uint64_t)node->kind * 0x9e3779b97f4a7c15u;
+  h ^= (uint64_t)(uintptr_t)node->lhs * 0xff51afd7ed558ccdu;
+  h ^= (uint64_t)(uintptr_t)node->rhs * 0xc4ceb9fe1a85ec53u;
+  switch (node->kind) {
+    case ND_NUM: {
+      uint64_t bits;
+      memcpy(&bits, &node->val, sizeof(bits));
+      h ^= bits;
+      break;
+    }
+    case ND_STR:
+    case ND_IDENTIFIER:
+      h ^= hash_string(node->sval);
+      break;
+    case ND_BOOL:
+    case ND_LT:
+    case ND_LE:
+      h ^= node->bval;
+      break;
+    default:
+      break;
+  }
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+static bool cons_equal(Node* a, Node* b) {
+  if (a->kind != b->kind || a->lhs != b->lhs || a->rhs != b->rhs) return false;
+  switch (a->kind) {
+    case ND_NUM:
+      return memcmp(&a->val, &b->val, sizeof(a->val)) == 0;
+    case ND_STR:
+    case ND_IDENTIFIER:
+      return strcmp(a->sval, b->sval) == 0;
+    case ND_BOOL:
+    case ND_LT:
+    case ND_LE:
+      return a->bval == b->bval;
+    default:
+      return true;
+  }
+}
+
+static void cons_insert(Node* node) {
+  size_t mask = cons_cap - 1;
+  size_t i = cons_hash(node) & mask;
+  while (cons_table[i]) i = (i + 1) & mask;
+  cons_table[i] = node;
+}
+
+static void cons_grow() {
+  Node** old = cons_table;
+  size_t old_cap = cons_cap;
+  cons_cap = cons_cap ? cons_cap * 2 : 1024;
+  cons_table = (Node**)calloc(cons_cap, sizeof(Node*));
+  if (!cons_table) {
+    fprintf(stderr, "メモリ確保に失敗しました。\n");
+    exit(74);
+  }
+  for (size_t i = 0; i < old_cap; ++i) {
+    if (old[i]) cons_insert(old[i]);
+  }
+  free(old);
+}
+
+// 作ったばかりのnodeと同じ形のノードがあればそれを返し、nodeはプールに戻す
+static Node* hashcons(Node* node) {
+  if (!consable(node->kind)) return node;
+  if ((node->lhs && !node->lhs->consed) || (node->rhs && !node->rhs->consed)) {
+    return node;
+  }
+
+  if ((cons_count + 1) * 4 > cons_cap * 3) cons_grow();
+  size_t mask = cons_cap - 1;
+  size_t i = cons_hash(node) & mask;
+  for (; cons_table[i]; i = (i + 1) & mask) {
+    Node* found = cons_table[i];
+    if (!cons_equal(found, node)) continue;
+
+    if (!found->shared) {
+      found->shared = true;
+      if (found->kind == ND_IDENTIFIER) found->slot = BINDING_UNRESOLVED;
+    }
+    stats.consed++;
+    if (node == node_pool - 1) {
+      memset(node, 0, sizeof(Node));
+      node_pool--;
+      node_pool_left++;
+      stats.nodes--;
+    }
+    return found;
+  }
+  node->consed = true;
+  cons_table[i] = node;
+  cons_count++;
   return node;
 }
 
+// プログラムごとに表を空にする（型推論の束縛の照合はプログラムの中で閉じている）
+static void cons_reset() {
+  if (cons_table) memset(cons_table, 0, cons_cap * sizeof(Node*));
+  cons_count = 0;
+}
+
 // pre-orderで深さ優先探索（？）すれば、S式らしくなるだろう
 #ifdef DEBUG
 static void print_ast(Node* node) {
@@ -583,8 +1412,12 @@ static void print_ast(Node* node) {
 // comparison -> term ( ">" | ">=" | "<" | "<=" ) term)*
 // term -> factor (("+" | "-") factor)*
 // factor -> unary (("*" | "/") unary)*
-// unary -> ( "-" | "!" ) unary | primary
-// primary -> NUMBER | STRING | "true" | "false" | "nil" | "(" expression ")";
+// unary -> ( "-" | "!" ) unary | call
+// call -> primary ( "(" arguments? ")" | "[" expression "]" )*
+// arguments -> expression ( "," expression )*
+// primary -> NUMBER | STRING | "true" | "false" | "nil" | "(" expression ")"
+//          | "[" arguments? "]";
+// （expression以下は、rulesの優先順位表によるPrattパーサで実装している）
 
 Node* program();
 Node* declaration();
@@ -597,17 +1430,9 @@ Node* printStmt();
 Node* whileStmt();
 Node* blockStmt();
 Node* expression();
-Node* assignment();
-Node* logic_or();
-Node* logic_and();
-Node* equality();
-Node* comparison();
-Node* term();
-Node* factor();
-Node* unary();
-Node* primary();
-
-Token* token;
+
+// --lazy: if/whileの{}の本体は括弧の対応だけ取って読み飛ばし、最初に実行するときにパースする
+static bool lazy_parse = false;
 
 bool match(TokenType type) {
   if (token->type != type) {
@@ -620,19 +1445,40 @@ bool match(TokenType type) {
 
 bool expect(TokenType type) { return token->type == type; }
 
+// 本体が{}ならトークンの範囲だけを覚えたND_LAZYを返す。中の構文エラーは実行時に報告する
+static Node* branch() {
+  if (!lazy_parse || !expect(TK_LEFT_BRACE)) return statement();
+
+  Token* start = token;
+  int depth = 0;
+  for (;;) {
+    if (token->type == TK_EOF) {
+      fprintf(stderr, "ブロックが、}で閉じてません\n");
+      exit(EX_DATAERR);
+    }
+    if (token->type == TK_LEFT_BRACE) depth++;
+    if (token->type == TK_RIGHT_BRACE && --depth == 0) break;
+    token = token->next;
+  }
+  token = token->next;
+
+  Node* node = new_node(ND_LAZY, NULL, NULL);
+  node->start = start;
+  stats.lazy_deferred++;
+  return node;
+}
+
 Node* program() {
   Node head_node = {0};
   Node* cur = &head_node;
+  cons_reset();
 
   while (token->type != TK_EOF) {
     cur->next = declaration();
     cur = cur->next;
   }
 
-  Node* node = (Node*)calloc(1, sizeof(Node));
-  node->kind = ND_PROGRAM;
-  node->lhs = head_node.next;
-  return node;
+  return new_node(ND_PROGRAM, head_node.next, NULL);
 }
 
 Node* declaration() {
@@ -648,6 +1494,7 @@ Node* varDecl() {
     exit(74);
   }
   char* val_name = token->lexeme;
+  int line = token->line;
   token = token->next;
   Node* node = NULL;
   if (match(TK_EQUAL)) {
@@ -659,6 +1506,7 @@ Node* varDecl() {
   }
   Node* variable_node = new_node(ND_DECLARATION, node, NULL);
   variable_node->sval = val_name;
+  variable_node->line = line;
   return variable_node;
 }
 
@@ -690,11 +1538,11 @@ Node* ifStmt() {
     fprintf(stderr, "if文の{}画閉じてません。\n");
     exit(EX_DATAERR);
   }
-  Node* then_statement = statement();
+  Node* then_statement = branch();
 
   Node* else_statement = NULL;
   if (match(TK_ELSE)) {
-    else_statement = statement();
+    else_statement = branch();
   }
 
   Node* n = new_node(ND_IF, condition, then_statement);
@@ -780,7 +1628,7 @@ Node* whileStmt() {
     exit(EX_DATAERR);
   }
 
-  return new_node(ND_WHILE, condition, statement());
+  return new_node(ND_WHILE, condition, branch());
 }
 
 Node* blockStmt() {
@@ -800,450 +1648,5247 @@ Node* blockStmt() {
   return new_node(ND_BLOCK, head.next, NULL);
 }
 
-Node* expression() { return assignment(); }
+// --- 式のパース（Pratt） ---
+// 各トークンに前置・中置の処理と優先順位を割り当て、優先順位が続く限り中置の処理を繰り返す。
+// 比較の ">" と ">=" は、従来どおり左右を入れ替えた ND_LT / ND_LE にする。
+// 評価はソースの順（左から）にするため、入れ替えたノードにはbvalを立てる。
+// 単項演算子・括弧・二項演算子の途中状態はCの再帰ではなくpstackに積むので、
+// どれだけ深い式でもネイティブのスタックは一定量しか使わない。
 
-Node* assignment() {
-  Node* node = logic_or();
+typedef enum {
+  PREC_NONE,
+  PREC_ASSIGNMENT,  // =
+  PREC_OR,          // or
+  PREC_AND,         // and
+  PREC_EQUALITY,    // == !=
+  PREC_COMPARISON,  // < > <= >=
+  PREC_TERM,        // + -
+  PREC_FACTOR,      // * /
+  PREC_UNARY,       // ! -
+  PREC_CALL,        // () []
+  PREC_PRIMARY,
+} Precedence;
 
-  if (match(TK_EQUAL)) {
-    Node* value = logic_or();
+typedef enum {
+  PRE_NONE,
+  PRE_ATOM,   // リテラル・識別子（atomで読む）
+  PRE_UNARY,  // - !
+  PRE_GROUP,  // (
+  PRE_ARRAY,  // [
+} PrefixKind;
 
-    if (node->kind != ND_IDENTIFIER) {
-      fprintf(stderr, "無効な代入先です\n");
-      exit(EX_DATAERR);
-    }
-    return new_node(ND_ASSIGN, node, value);
-  }
+typedef enum {
+  IN_NONE,
+  IN_BINARY,  // 左結合の二項演算子
+  IN_ASSIGN,  // 右結合の代入
+  IN_CALL,    // 関数呼び出し f(...)
+  IN_INDEX,   // 添字 a[i]
+} InfixKind;
+
+typedef Node* (*AtomFn)();
+
+typedef struct {
+  PrefixKind prefix;
+  InfixKind infix;
+  Precedence prec;
+  NodeKind kind;  // 中置の場合に作るノード
+  bool swap;      // 左右を入れ替えるか
+  AtomFn atom;
+} ParseRule;
+
+static Node* number();
+static Node* string();
+static Node* literal();
+static Node* variable();
+
+static ParseRule rules[] = {
+    [TK_LEFT_PAREN] = {PRE_GROUP, IN_CALL, PREC_CALL},
+    [TK_LEFT_BRACKET] = {PRE_ARRAY, IN_INDEX, PREC_CALL},
+    [TK_MINUS] = {PRE_UNARY, IN_BINARY, PREC_TERM, ND_MINUS},
+    [TK_PLUS] = {PRE_NONE, IN_BINARY, PREC_TERM, ND_ADD},
+    [TK_STAR] = {PRE_NONE, IN_BINARY, PREC_FACTOR, ND_MUL},
+    [TK_SLASH] = {PRE_NONE, IN_BINARY, PREC_FACTOR, ND_DIV},
+    [TK_EQUAL] = {PRE_NONE, IN_ASSIGN, PREC_ASSIGNMENT},
+    [TK_EQUAL_EQUAL] = {PRE_NONE, IN_BINARY, PREC_EQUALITY, ND_EQ},
+    [TK_BANG] = {PRE_UNARY, IN_NONE, PREC_NONE},
+    [TK_BANG_EQUAL] = {PRE_NONE, IN_BINARY, PREC_EQUALITY, ND_NE},
+    [TK_LESS] = {PRE_NONE, IN_BINARY, PREC_COMPARISON, ND_LT},
+    [TK_LESS_EQUAL] = {PRE_NONE, IN_BINARY, PREC_COMPARISON, ND_LE},
+    [TK_GREATER] = {PRE_NONE, IN_BINARY, PREC_COMPARISON, ND_LT, true},
+    [TK_GREATER_EQUAL] = {PRE_NONE, IN_BINARY, PREC_COMPARISON, ND_LE, true},
+    [TK_STRING] = {PRE_ATOM, IN_NONE, PREC_NONE, 0, false, string},
+    [TK_NUMBER] = {PRE_ATOM, IN_NONE, PREC_NONE, 0, false, number},
+    [TK_IDENTIFIER] = {PRE_ATOM, IN_NONE, PREC_NONE, 0, false, variable},
+    [TK_AND] = {PRE_NONE, IN_BINARY, PREC_AND, ND_AND},
+    [TK_OR] = {PRE_NONE, IN_BINARY, PREC_OR, ND_OR},
+    [TK_FALSE] = {PRE_ATOM, IN_NONE, PREC_NONE, 0, false, literal},
+    [TK_NIL] = {PRE_ATOM, IN_NONE, PREC_NONE, 0, false, literal},
+    [TK_TRUE] = {PRE_ATOM, IN_NONE, PREC_NONE, 0, false, literal},
+    [TK_WHILE] = {PRE_NONE, IN_NONE, PREC_NONE},  // 表の大きさを最後のトークンに合わせる
+};
 
-  return node;
+static ParseRule* get_rule(TokenType type) {
+  static ParseRule none = {0};
+  if (type < 0) return &none;
+  return &rules[type];
 }
 
-Node* logic_or() {
-  Node* node = logic_and();
-  while (match(TK_OR)) {
-    node = new_node(ND_OR, node, logic_and());
+// パース途中の演算子。右辺（括弧なら中身）を読み終えたときに取り出してノードにする。
+typedef struct {
+  PrefixKind prefix;  // PRE_UNARY / PRE_GROUP / PRE_ARRAY のとき前置
+  ParseRule* rule;    // 中置のときの規則
+  TokenType op;
+  Node* lhs;
+  Node* head;  // 引数・要素の並び
+  Node* tail;
+  Precedence prec;  // 積む前の優先順位
+} ParseFrame;
+
+static ParseFrame* pstack;
+static size_t pstack_len;
+static size_t pstack_cap;
+
+static void pstack_push(ParseFrame f) {
+  if (pstack_len == pstack_cap) {
+    pstack_cap = pstack_cap ? pstack_cap * 2 : 64;
+    pstack = realloc(pstack, pstack_cap * sizeof(ParseFrame));
+    if (!pstack) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
   }
-  return node;
+  pstack[pstack_len++] = f;
 }
 
-Node* logic_and() {
-  Node* node = equality();
-  while (match(TK_AND)) {
-    node = new_node(ND_AND, node, equality());
-  }
-  return node;
-}
+static Node* parse_precedence(Precedence prec);
+
+Node* expression() { return parse_precedence(PREC_ASSIGNMENT); }
 
-Node* equality() {
-  Node* node = comparison();
+static Node* parse_precedence(Precedence prec) {
+  size_t base = pstack_len;
 
   for (;;) {
-    if (match(TK_EQUAL_EQUAL)) {
-      node = new_node(ND_EQ, node, comparison());
-    } else if (match(TK_BANG_EQUAL)) {
-      node = new_node(ND_NE, node, comparison());
-    } else {
-      return node;
+    // 前置：単項演算子と開き括弧は積んでおき、オペランドを読むまで進む
+    ParseRule* rule = get_rule(token->type);
+    Node* node;
+    if (rule->prefix == PRE_UNARY || rule->prefix == PRE_GROUP) {
+      pstack_push((ParseFrame){.prefix = rule->prefix, .op = token->type, .prec = prec});
+      prec = rule->prefix == PRE_UNARY ? PREC_UNARY : PREC_ASSIGNMENT;
+      token = token->next;
+      continue;
     }
+    if (rule->prefix == PRE_ARRAY) {
+      token = token->next;
+      if (!match(TK_RIGHT_BRACKET)) {
+        pstack_push((ParseFrame){.prefix = PRE_ARRAY, .prec = prec});
+        prec = PREC_ASSIGNMENT;
+        continue;
+      }
+      node = new_node(ND_ARRAY, NULL, NULL);
+    } else if (rule->prefix == PRE_ATOM) {
+      node = hashcons(rule->atom());
+    } else {
+      fprintf(stderr, "式が必要です。\n");
+      exit(EX_DATAERR);
+    }
+
+    // 中置：続けられるなら演算子を積んで右辺へ、続けられなければ積んだものを畳む
+    for (;;) {
+      ParseRule* infix = get_rule(token->type);
+      if (infix->infix != IN_NONE && infix->prec >= prec) {
+        token = token->next;
+        if (infix->infix == IN_CALL && match(TK_RIGHT_PAREN)) {
+          node = new_node(ND_CALL, node, NULL);
+          continue;
+        }
+        pstack_push((ParseFrame){.rule = infix, .op = token->type, .lhs = node, .prec = prec});
+        prec = infix->infix == IN_BINARY ? infix->prec + 1 : PREC_ASSIGNMENT;
+        break;
+      }
+
+      if (pstack_len == base) return node;
+
+      // 引数・要素の並び：","なら次の式へ、閉じ括弧なら並びを畳む
+      ParseFrame* top = &pstack[pstack_len - 1];
+      if (top->prefix == PRE_ARRAY || (top->rule && top->rule->infix == IN_CALL)) {
+        Node* arg = new_node(ND_ARG, node, NULL);
+        if (top->tail) {
+          top->tail->rhs = arg;
+        } else {
+          top->head = arg;
+        }
+        top->tail = arg;
+        if (match(TK_COMMA)) {
+          prec = PREC_ASSIGNMENT;
+          break;
+        }
+
+        ParseFrame f = pstack[--pstack_len];
+        prec = f.prec;
+        if (f.prefix == PRE_ARRAY) {
+          if (!match(TK_RIGHT_BRACKET)) {
+            fprintf(stderr, "配列が]で閉じていません。\n");
+            exit(EX_DATAERR);
+          }
+          node = new_node(ND_ARRAY, f.head, NULL);
+        } else {
+          if (!match(TK_RIGHT_PAREN)) {
+            fprintf(stderr, "引数が)で閉じていません。\n");
+            exit(EX_DATAERR);
+          }
+          node = new_node(ND_CALL, f.lhs, f.head);
+        }
+        continue;
+      }
+
+      ParseFrame f = pstack[--pstack_len];
+      prec = f.prec;
+
+      if (f.prefix == PRE_GROUP) {
+        if (!match(TK_RIGHT_PAREN)) {
+          fprintf(stderr, "式が括弧で閉じていません。\n");
+          exit(EX_DATAERR);
+        }
+      } else if (f.prefix == PRE_UNARY) {
+        node = hashcons(new_node(f.op == TK_MINUS ? ND_NEG : ND_BANG, node, NULL));
+      } else if (f.rule->infix == IN_INDEX) {
+        if (!match(TK_RIGHT_BRACKET)) {
+          fprintf(stderr, "添字が]で閉じていません。\n");
+          exit(EX_DATAERR);
+        }
+        node = new_node(ND_INDEX, f.lhs, node);
+      } else if (f.rule->infix == IN_ASSIGN) {
+        if (f.lhs->kind == ND_INDEX) {
+          node = new_node(ND_SET_INDEX, f.lhs, node);
+        } else if (f.lhs->kind == ND_IDENTIFIER) {
+          node = new_node(ND_ASSIGN, f.lhs, node);
+        } else {
+          fprintf(stderr, "無効な代入先です\n");
+          exit(EX_DATAERR);
+        }
+      } else if (f.rule->swap) {
+        Node* swapped = new_node(f.rule->kind, node, f.lhs);
+        swapped->bval = true;
+        node = hashcons(swapped);
+      } else {
+        node = hashcons(new_node(f.rule->kind, f.lhs, node));
+      }
+    }
+  }
+}
+
+static Node* number() {
+  double val = strtod(token->lexeme, NULL);
+  token = token->next;
+  return new_node_num(val);
+}
+
+static Node* string() {
+  char* val = token->lexeme;
+  token = token->next;
+  return new_node_str(val);
+}
+
+static Node* literal() {
+  TokenType type = token->type;
+  token = token->next;
+  if (type == TK_NIL) return new_node_nil();
+  return new_node_bool(type == TK_TRUE);
+}
+
+static Node* variable() {
+  char* name = token->lexeme;
+  token = token->next;
+
+  Node* node = new_node(ND_IDENTIFIER, NULL, NULL);
+  node->sval = name;
+  return node;
+}
+
+// --- ループの最適化 ---
+// ND_WHILEごとに、条件式と本体で代入・宣言される変数を集め、それ以外の変数とリテラル
+// だけからなる部分式をND_INVARIANTで包む。ND_INVARIANTは最初に評価した値を
+// loop_tempsに覚え、ループに入り直すまで評価し直さない。ループの手前で先に計算する
+// のではなく最初に使われたときに計算するので、実行されない式がエラーになることはない。
+// また、ループ内の i = i + c / i = i - c をND_INCREMENTにして、変数の検索を一回で済ませる。
+
+typedef struct {
+  Value value;
+  bool valid;
+  Node* loop;  // この値を持つND_WHILE
+} LoopTemp;
+
+static LoopTemp* loop_temps;
+static size_t loop_temps_len;
+static size_t loop_temps_cap;
+
+// ループに入るたびに不変式の値を計算し直す
+static void loop_temps_reset(Node* loop) {
+  for (size_t i = loop->slot; i < loop_temps_len && loop_temps[i].loop == loop; ++i) {
+    loop_temps[i].valid = false;
+  }
+}
+
+static bool optimize = true;
+
+#define OPT_MAX_DEPTH 1000  // これより深い木は最適化しない
+
+// ループ内で値が変わりうる変数の名前
+typedef struct {
+  char** names;
+  uint32_t* hashes;
+  size_t len;
+  size_t cap;
+  bool too_deep;  // 深すぎるか、未パースの本体があって調べきれなかった
+} NameSet;
+
+static void nameset_add(NameSet* set, char* name) {
+  uint32_t hash = hash_string(name);
+  for (size_t i = 0; i < set->len; ++i) {
+    if (set->hashes[i] == hash && strcmp(set->names[i], name) == 0) return;
+  }
+  if (set->len == set->cap) {
+    set->cap = set->cap ? set->cap * 2 : 8;
+    set->names = realloc(set->names, set->cap * sizeof(char*));
+    set->hashes = realloc(set->hashes, set->cap * sizeof(uint32_t));
+  }
+  set->names[set->len] = name;
+  set->hashes[set->len] = hash;
+  set->len++;
+}
+
+static bool nameset_has(NameSet* set, char* name) {
+  uint32_t hash = hash_string(name);
+  for (size_t i = 0; i < set->len; ++i) {
+    if (set->hashes[i] == hash && strcmp(set->names[i], name) == 0) return true;
+  }
+  return false;
+}
+
+static void collect_assigned(Node* node, NameSet* set, int depth) {
+  if (!node) return;
+  if (depth > OPT_MAX_DEPTH) {
+    set->too_deep = true;
+    return;
+  }
+
+  switch (node->kind) {
+    case ND_PROGRAM:
+    case ND_BLOCK:
+      for (Node* s = node->lhs; s != NULL; s = s->next) {
+        collect_assigned(s, set, depth + 1);
+      }
+      return;
+    case ND_DECLARATION:
+      nameset_add(set, node->sval);
+      collect_assigned(node->lhs, set, depth + 1);
+      return;
+    case ND_ASSIGN:
+      nameset_add(set, node->lhs->sval);
+      collect_assigned(node->rhs, set, depth + 1);
+      return;
+    case ND_INCREMENT:
+      nameset_add(set, node->sval);
+      return;
+    case ND_IF:
+      collect_assigned(node->alt, set, depth + 1);
+      break;
+    case ND_LAZY:
+      set->too_deep = true;
+      return;
+    default:
+      break;
+  }
+  collect_assigned(node->lhs, set, depth + 1);
+  collect_assigned(node->rhs, set, depth + 1);
+}
+
+// 評価し直しを省く価値のある（演算を含む）式か
+static bool worth_hoisting(Node* node) {
+  switch (node->kind) {
+    case ND_ADD:
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_NEG:
+    case ND_LT:
+    case ND_LE:
+    case ND_EQ:
+    case ND_NE:
+    case ND_BANG:
+    case ND_OR:
+    case ND_AND:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void wrap_invariant(Node** slot, Node* loop) {
+  if (!worth_hoisting(*slot)) return;
+
+  if (loop_temps_len == loop_temps_cap) {
+    loop_temps_cap = loop_temps_cap ? loop_temps_cap * 2 : 64;
+    loop_temps = realloc(loop_temps, loop_temps_cap * sizeof(LoopTemp));
+    if (!loop_temps) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  loop_temps[loop_temps_len] = (LoopTemp){.loop = loop};
+
+  Node* node = new_node(ND_INVARIANT, *slot, NULL);
+  node->slot = (int)loop_temps_len++;
+  *slot = node;
+}
+
+// x = x + c, x = c + x, x = x - c を ND_INCREMENT に置き換える
+static void reduce_increment(Node* node) {
+  char* name = node->lhs->sval;
+  Node* rhs = node->rhs;
+  if (rhs->kind != ND_ADD && rhs->kind != ND_MINUS) return;
+
+  Node* var = rhs->lhs;
+  Node* step = rhs->rhs;
+  if (rhs->kind == ND_ADD && var->kind == ND_NUM) {
+    var = rhs->rhs;
+    step = rhs->lhs;
+  }
+  if (var->kind != ND_IDENTIFIER || step->kind != ND_NUM) return;
+  if (strcmp(var->sval, name) != 0) return;
+
+  node->kind = ND_INCREMENT;
+  node->sval = name;
+  node->val = rhs->kind == ND_ADD ? step->val : -step->val;
+  node->bval = rhs->kind == ND_MINUS;
+  node->lhs = NULL;
+  node->rhs = NULL;
+}
+
+// 部分式がループ不変ならtrueを返す。包むかどうかは親が決める。
+static bool hoist_expr(Node** slot, NameSet* varying, Node* loop, int depth) {
+  Node* node = *slot;
+  if (depth > OPT_MAX_DEPTH) return false;
+
+  switch (node->kind) {
+    case ND_NUM:
+    case ND_STR:
+    case ND_BOOL:
+    case ND_NIL:
+      return true;
+
+    case ND_IDENTIFIER:
+      return !nameset_has(varying, node->sval);
+
+    case ND_INVARIANT:
+      return hoist_expr(&node->lhs, varying, loop, depth + 1);
+
+    case ND_NEG:
+    case ND_BANG:
+      return hoist_expr(&node->lhs, varying, loop, depth + 1);
+
+    case ND_ADD:
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_LT:
+    case ND_LE:
+    case ND_EQ:
+    case ND_NE:
+    case ND_OR:
+    case ND_AND: {
+      bool lhs = hoist_expr(&node->lhs, varying, loop, depth + 1);
+      bool rhs = hoist_expr(&node->rhs, varying, loop, depth + 1);
+      if (lhs && rhs) return true;
+      if (node->shared) return false;
+      if (lhs) wrap_invariant(&node->lhs, loop);
+      if (rhs) wrap_invariant(&node->rhs, loop);
+      return false;
+    }
+
+    case ND_ASSIGN:
+      reduce_increment(node);
+      if (node->kind == ND_ASSIGN &&
+          hoist_expr(&node->rhs, varying, loop, depth + 1)) {
+        wrap_invariant(&node->rhs, loop);
+      }
+      return false;
+
+    default:
+      return false;
+  }
+}
+
+static void hoist_root(Node** slot, NameSet* varying, Node* loop) {
+  if (*slot && hoist_expr(slot, varying, loop, 0)) wrap_invariant(slot, loop);
+}
+
+static void hoist_stmt(Node* node, NameSet* varying, Node* loop, int depth) {
+  if (!node || depth > OPT_MAX_DEPTH) return;
+
+  switch (node->kind) {
+    case ND_BLOCK:
+      for (Node* s = node->lhs; s != NULL; s = s->next) {
+        hoist_stmt(s, varying, loop, depth + 1);
+      }
+      return;
+    case ND_EXPR_STMT:
+    case ND_PRINT_STMT:
+    case ND_DECLARATION:
+      hoist_root(&node->lhs, varying, loop);
+      return;
+    case ND_IF:
+      hoist_root(&node->lhs, varying, loop);
+      hoist_stmt(node->rhs, varying, loop, depth + 1);
+      hoist_stmt(node->alt, varying, loop, depth + 1);
+      return;
+    case ND_WHILE:
+      hoist_root(&node->lhs, varying, loop);
+      hoist_stmt(node->rhs, varying, loop, depth + 1);
+      return;
+    default:
+      return;
+  }
+}
+
+static void vectorize_loop(Node* node);
+
+// 内側のループから順に最適化する
+static void optimize_loops(Node* node, int depth) {
+  if (!node || depth > OPT_MAX_DEPTH) return;
+
+  switch (node->kind) {
+    case ND_PROGRAM:
+    case ND_BLOCK:
+      for (Node* s = node->lhs; s != NULL; s = s->next) {
+        optimize_loops(s, depth + 1);
+      }
+      return;
+    case ND_IF:
+      optimize_loops(node->rhs, depth + 1);
+      optimize_loops(node->alt, depth + 1);
+      return;
+    case ND_WHILE: {
+      optimize_loops(node->rhs, depth + 1);
+
+      // ほとんど回らないループでは、不変式を覚えても入るたびに捨てるだけ
+      NameSet varying = {0};
+      collect_assigned(node->lhs, &varying, 0);
+      collect_assigned(node->rhs, &varying, 0);
+      if (!varying.too_deep && !(node->pgo & PGO_COLD)) {
+        node->slot = (int)loop_temps_len;
+        hoist_root(&node->lhs, &varying, node);
+        hoist_stmt(node->rhs, &varying, node, 0);
+      }
+      free(varying.names);
+      free(varying.hashes);
+
+      vectorize_loop(node);
+      return;
+    }
+    default:
+      return;
+  }
+}
+
+// --- 総和ループのベクトル化 ---
+// for (var i = a; i < N; i = i + c) { acc = acc + f(i); } のように、本体が
+// 「帰納変数の純粋な数式を足し込むだけ」のループをND_REDUCEに置き換える。
+// f(i)は数値・i・ループ内で変わらない変数と四則演算だけからなるものに限り、
+// 後置記法の命令列にしておく。実行時は i の値をREDUCE_BLOCK個ずつ並べ、
+// 命令列をSIMDで一度に評価してから acc に足し込む。
+// 足し込みは既定では元と同じ順に逐次行うので結果はビット単位で一致する。
+// --fast-math のときだけ4本の部分和に分けて足す（結合順序が変わる）。
+
+typedef enum {
+  RK_CONST,  // 定数
+  RK_INDEX,  // 帰納変数
+  RK_VAR,    // ループ内で変わらない変数
+  RK_ADD,
+  RK_SUB,
+  RK_MUL,
+  RK_DIV,
+  RK_NEG,
+} ReduceOp;
+
+typedef struct {
+  ReduceOp op;
+  double num;  // RK_CONSTの値。RK_VARは実行時に変数の値を入れる
+  char* name;  // RK_VARの変数名
+} ReduceInsn;
+
+typedef struct {
+  char* index;  // 帰納変数
+  char* acc;    // 足し込む変数
+  Node* bound;  // index < bound
+  bool inclusive;  // <= なら true
+  double step;
+  bool subtract;  // acc = acc - f(i)
+  ReduceInsn* code;
+  size_t len;
+  size_t cap;
+  size_t max_stack;
+} Reduction;
+
+#define REDUCE_BLOCK 256
+
+static Reduction* reductions;
+static size_t reductions_len;
+static size_t reductions_cap;
+
+static bool fast_math = false;
+
+static void reduce_emit(Reduction* r, ReduceOp op, double num, char* name) {
+  if (r->len == r->cap) {
+    r->cap = r->cap ? r->cap * 2 : 16;
+    r->code = realloc(r->code, r->cap * sizeof(ReduceInsn));
+  }
+  r->code[r->len++] = (ReduceInsn){op, num, name};
+}
+
+// f(i)を命令列にする。使えない式ならfalse
+static bool reduce_compile(Reduction* r, Node* node, size_t height, int depth) {
+  if (depth > OPT_MAX_DEPTH) return false;
+  if (height + 1 > r->max_stack) r->max_stack = height + 1;
+
+  switch (node->kind) {
+    case ND_NUM:
+      reduce_emit(r, RK_CONST, node->val, NULL);
+      return true;
+    case ND_IDENTIFIER:
+      if (strcmp(node->sval, r->acc) == 0) return false;
+      if (strcmp(node->sval, r->index) == 0) {
+        reduce_emit(r, RK_INDEX, 0, NULL);
+      } else {
+        reduce_emit(r, RK_VAR, 0, node->sval);
+      }
+      return true;
+    case ND_INVARIANT:
+      return reduce_compile(r, node->lhs, height, depth + 1);
+    case ND_NEG:
+      if (!reduce_compile(r, node->lhs, height, depth + 1)) return false;
+      reduce_emit(r, RK_NEG, 0, NULL);
+      return true;
+    case ND_ADD:
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV: {
+      if (!reduce_compile(r, node->lhs, height, depth + 1)) return false;
+      if (!reduce_compile(r, node->rhs, height + 1, depth + 1)) return false;
+      ReduceOp op = node->kind == ND_ADD     ? RK_ADD
+                    : node->kind == ND_MINUS ? RK_SUB
+                    : node->kind == ND_MUL   ? RK_MUL
+                                             : RK_DIV;
+      reduce_emit(r, op, 0, NULL);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// 1文だけのブロックなら中身を返す
+static Node* single_statement(Node* node) {
+  while (node && node->kind == ND_BLOCK && node->lhs && !node->lhs->next) {
+    node = node->lhs;
+  }
+  return node;
+}
+
+static void vectorize_loop(Node* loop) {
+  // 条件: i < bound / i <= bound
+  Node* cond = loop->lhs;
+  if (cond->kind != ND_LT && cond->kind != ND_LE) return;
+  if (cond->lhs->kind != ND_IDENTIFIER) return;
+  Node* bound = cond->rhs;
+  if (bound->kind != ND_NUM && bound->kind != ND_INVARIANT &&
+      bound->kind != ND_IDENTIFIER) {
+    return;
+  }
+  char* index = cond->lhs->sval;
+  if (bound->kind == ND_IDENTIFIER && strcmp(bound->sval, index) == 0) return;
+
+  // 本体: { 更新; i = i + c; }
+  Node* body = loop->rhs;
+  if (body->kind != ND_BLOCK || !body->lhs || !body->lhs->next ||
+      body->lhs->next->next) {
+    return;
+  }
+  Node* inc = body->lhs->next;
+  if (inc->kind != ND_EXPR_STMT || inc->lhs->kind != ND_INCREMENT ||
+      strcmp(inc->lhs->sval, index) != 0 || !(inc->lhs->val > 0)) {
+    return;
+  }
+
+  Node* update = single_statement(body->lhs);
+  if (!update || update->kind != ND_EXPR_STMT) return;
+  update = update->lhs;
+
+  Reduction r = {.index = index, .bound = bound, .inclusive = cond->kind == ND_LE,
+                 .step = inc->lhs->val};
+  Node* f = NULL;
+  if (update->kind == ND_INCREMENT) {
+    // acc = acc + c はND_INCREMENTになっている
+    r.acc = update->sval;
+    if (strcmp(r.acc, index) == 0) return;
+    reduce_emit(&r, RK_CONST, update->val, NULL);
+    r.max_stack = 1;
+  } else if (update->kind == ND_ASSIGN) {
+    r.acc = update->lhs->sval;
+    Node* rhs = update->rhs;
+    if (strcmp(r.acc, index) == 0) return;
+    if (rhs->kind == ND_ADD && rhs->lhs->kind == ND_IDENTIFIER &&
+        strcmp(rhs->lhs->sval, r.acc) == 0) {
+      f = rhs->rhs;
+    } else if (rhs->kind == ND_ADD && rhs->rhs->kind == ND_IDENTIFIER &&
+               strcmp(rhs->rhs->sval, r.acc) == 0) {
+      f = rhs->lhs;
+    } else if (rhs->kind == ND_MINUS && rhs->lhs->kind == ND_IDENTIFIER &&
+               strcmp(rhs->lhs->sval, r.acc) == 0) {
+      f = rhs->rhs;
+      r.subtract = true;
+    } else {
+      return;
+    }
+    if (!reduce_compile(&r, f, 0, 0)) {
+      free(r.code);
+      return;
+    }
+  } else {
+    return;
+  }
+  if (bound->kind == ND_IDENTIFIER && strcmp(bound->sval, r.acc) == 0) {
+    free(r.code);
+    return;
+  }
+
+  if (reductions_len == reductions_cap) {
+    reductions_cap = reductions_cap ? reductions_cap * 2 : 16;
+    reductions = realloc(reductions, reductions_cap * sizeof(Reduction));
+  }
+  reductions[reductions_len] = r;
+
+  // 元のループは実行時に条件を満たさなかったときのために残す
+  Node* original = new_node(ND_WHILE, NULL, NULL);
+  *original = *loop;
+  original->next = NULL;
+  for (size_t i = loop->slot; i < loop_temps_len && loop_temps[i].loop == loop; ++i) {
+    loop_temps[i].loop = original;
+  }
+  loop->kind = ND_REDUCE;
+  loop->lhs = original;
+  loop->rhs = NULL;
+  loop->slot = (int)reductions_len++;
+}
+
+// --- 型推論 ---
+// 関数がなく、宣言と代入はすべて構文木に見えているので、変数ごとに代入されうる
+// 値の型を不動点まで求める。スコープは実行時と同じ規則で静的に解決する
+// （ブロックは実行のたびに新しい環境になるので、ある位置の名前が指す変数は決まる）。
+// 宣言より前の参照や、スナップショット・REPLの前の行で定義された変数は型不明とする。
+// 数値だけで計算できる部分式はND_FEXPRにして、タグを見ずにdoubleのまま評価する。
+// 数値と分かっている変数への代入は、タグを書かずに値だけを書き換える。
+
+typedef enum {
+  TY_NONE,  // まだ何も流れ込んでいない
+  TY_NUM,
+  TY_BOOL,
+  TY_STR,
+  TY_NIL,
+  TY_ARRAY,
+  TY_ANY,  // 複数の型になりうるか、分からない
+} Type;
+
+static const char* type_names[] = {"none", "num",   "bool", "string",
+                                   "nil",  "array", "any"};
+
+typedef struct {
+  char* name;
+  int depth;  // 宣言したスコープの深さ（0がトップレベル）
+  Type type;
+} Binding;
+
+static Binding* bindings;
+static size_t bindings_len;
+static size_t bindings_cap;
+
+static Env* type_scope;      // 名前から束縛の番号へ（値にnumで入れる）
+static int type_depth;
+static bool type_too_deep;   // 深すぎるか、未パースの本体があった
+static bool type_changed;    // 不動点の反復で束縛の型が変わった
+static bool dump_types = false;
+
+static int type_resolve(char* name) {
+  uint32_t hash = hash_string(name);
+  for (Env* env = type_scope; env != NULL; env = env->enclosing) {
+    Entry* e = env_find(env, name, hash);
+    if (e) return (int)e->value.num;
+  }
+  return -1;
+}
+
+// 同じスコープでの再宣言は同じ変数を上書きするので、同じ束縛にする
+static int type_declare(char* name) {
+  Entry* e = env_find(type_scope, name, hash_string(name));
+  if (e) return (int)e->value.num;
+
+  if (bindings_len == bindings_cap) {
+    bindings_cap = bindings_cap ? bindings_cap * 2 : 64;
+    bindings = realloc(bindings, bindings_cap * sizeof(Binding));
+    if (!bindings) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  bindings[bindings_len] = (Binding){name, type_depth, TY_NONE};
+  env_define(type_scope, name, value_num((double)bindings_len));
+  return (int)bindings_len++;
+}
+
+static void resolve_expr(Node* node, int depth) {
+  if (!node) return;
+  if (depth > OPT_MAX_DEPTH) {
+    type_too_deep = true;
+    return;
+  }
+
+  switch (node->kind) {
+    case ND_IDENTIFIER: {
+      int id = type_resolve(node->sval);
+      // 共有している識別子が場所によって別の変数を指すなら、型は分からない
+      if (node->shared && node->slot != BINDING_UNRESOLVED && node->slot != id) {
+        id = -1;
+      }
+      node->slot = id;
+      return;
+    }
+    case ND_INCREMENT:
+      node->slot = type_resolve(node->sval);
+      return;
+    case ND_ASSIGN:
+      resolve_expr(node->rhs, depth + 1);
+      node->slot = type_resolve(node->lhs->sval);
+      return;
+    case ND_ARG:
+      for (Node* a = node; a != NULL; a = a->rhs) resolve_expr(a->lhs, depth + 1);
+      return;
+    default:
+      resolve_expr(node->lhs, depth + 1);
+      resolve_expr(node->rhs, depth + 1);
+  }
+}
+
+static void resolve_stmt(Node* node, int depth) {
+  if (!node) return;
+  if (depth > OPT_MAX_DEPTH) {
+    type_too_deep = true;
+    return;
+  }
+
+  switch (node->kind) {
+    case ND_PROGRAM:
+      for (Node* s = node->lhs; s != NULL; s = s->next) resolve_stmt(s, depth + 1);
+      return;
+    case ND_BLOCK:
+      type_scope = env_push(type_scope);
+      type_depth++;
+      for (Node* s = node->lhs; s != NULL; s = s->next) resolve_stmt(s, depth + 1);
+      type_depth--;
+      type_scope = env_pop(type_scope);
+      return;
+    case ND_DECLARATION:
+      resolve_expr(node->lhs, depth + 1);
+      node->slot = type_declare(node->sval);
+      return;
+    case ND_IF:
+      resolve_expr(node->lhs, depth + 1);
+      resolve_stmt(node->rhs, depth + 1);
+      resolve_stmt(node->alt, depth + 1);
+      return;
+    case ND_WHILE:
+      resolve_expr(node->lhs, depth + 1);
+      resolve_stmt(node->rhs, depth + 1);
+      return;
+    case ND_REDUCE:
+      resolve_stmt(node->lhs, depth + 1);
+      return;
+    case ND_LAZY:
+      type_too_deep = true;
+      return;
+    default:
+      resolve_expr(node->lhs, depth + 1);
+  }
+}
+
+static Type type_join(Type a, Type b) {
+  if (a == TY_NONE) return b;
+  if (b == TY_NONE || a == b) return a;
+  return TY_ANY;
+}
+
+static void binding_join(int id, Type t) {
+  if (id < 0) return;
+  Type joined = type_join(bindings[id].type, t);
+  if (joined != bindings[id].type) {
+    bindings[id].type = joined;
+    type_changed = true;
+  }
+}
+
+static Type infer_expr(Node* node, int depth) {
+  if (depth > OPT_MAX_DEPTH) return TY_ANY;
+
+  switch (node->kind) {
+    case ND_NUM:
+      return TY_NUM;
+    case ND_STR:
+      return TY_STR;
+    case ND_BOOL:
+      return TY_BOOL;
+    case ND_NIL:
+      return TY_NIL;
+    case ND_IDENTIFIER:
+      return node->slot < 0 ? TY_ANY : bindings[node->slot].type;
+    case ND_INVARIANT:
+      return infer_expr(node->lhs, depth + 1);
+    case ND_NEG:
+      // 数値でなければ実行時エラーになるので、値としては必ず数値
+      infer_expr(node->lhs, depth + 1);
+      return TY_NUM;
+    case ND_BANG:
+      infer_expr(node->lhs, depth + 1);
+      return TY_BOOL;
+    case ND_ADD: {
+      Type l = infer_expr(node->lhs, depth + 1);
+      Type r = infer_expr(node->rhs, depth + 1);
+      if (l == TY_NONE || r == TY_NONE) return TY_NONE;
+      if (l == r && (l == TY_NUM || l == TY_STR)) return l;
+      return TY_ANY;
+    }
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV:
+      infer_expr(node->lhs, depth + 1);
+      infer_expr(node->rhs, depth + 1);
+      return TY_NUM;
+    case ND_LT:
+    case ND_LE:
+    case ND_EQ:
+    case ND_NE:
+      infer_expr(node->lhs, depth + 1);
+      infer_expr(node->rhs, depth + 1);
+      return TY_BOOL;
+    case ND_AND:
+    case ND_OR:
+      return type_join(infer_expr(node->lhs, depth + 1),
+                       infer_expr(node->rhs, depth + 1));
+    case ND_ASSIGN: {
+      Type t = infer_expr(node->rhs, depth + 1);
+      binding_join(node->slot, t);
+      return t;
+    }
+    case ND_INCREMENT:
+      binding_join(node->slot, TY_NUM);
+      return TY_NUM;
+    case ND_INDEX:
+      infer_expr(node->lhs, depth + 1);
+      infer_expr(node->rhs, depth + 1);
+      return TY_NUM;
+    case ND_SET_INDEX:
+      infer_expr(node->lhs, depth + 1);
+      infer_expr(node->rhs, depth + 1);
+      return TY_NUM;
+    case ND_ARRAY:
+      for (Node* a = node->lhs; a != NULL; a = a->rhs) infer_expr(a->lhs, depth + 1);
+      return TY_ARRAY;
+    case ND_CALL:
+      infer_expr(node->lhs, depth + 1);
+      for (Node* a = node->rhs; a != NULL; a = a->rhs) infer_expr(a->lhs, depth + 1);
+      return TY_ANY;
+    default:
+      return TY_ANY;
+  }
+}
+
+static void infer_stmt(Node* node, int depth) {
+  if (!node || depth > OPT_MAX_DEPTH) return;
+
+  switch (node->kind) {
+    case ND_PROGRAM:
+    case ND_BLOCK:
+      for (Node* s = node->lhs; s != NULL; s = s->next) infer_stmt(s, depth + 1);
+      return;
+    case ND_DECLARATION:
+      binding_join(node->slot,
+                   node->lhs ? infer_expr(node->lhs, depth + 1) : TY_NIL);
+      return;
+    case ND_IF:
+      infer_expr(node->lhs, depth + 1);
+      infer_stmt(node->rhs, depth + 1);
+      infer_stmt(node->alt, depth + 1);
+      return;
+    case ND_WHILE:
+      infer_expr(node->lhs, depth + 1);
+      infer_stmt(node->rhs, depth + 1);
+      return;
+    case ND_REDUCE:
+      infer_stmt(node->lhs, depth + 1);
+      return;
+    default:
+      if (node->lhs) infer_expr(node->lhs, depth + 1);
+  }
+}
+
+// --- 不要な宣言と代入の削除 ---
+// 型推論で解決した束縛の上で、値が観測される（print・条件・呼び出しの引数・添字などで
+// 読まれる）変数を根から辿り、どこからも読まれない変数の宣言と代入を消す。
+// 代入の右辺に副作用や実行時エラーの可能性があれば、右辺だけを式文として残す。
+// また、同じ文の並びの中で読まれる前に次の代入で上書きされる代入も消す
+// （この言語には途中で抜ける文がないので、後の代入は必ず実行される）。
+// REPL・--snapshot-out・--setupのトップレベルの変数は後から読まれるので消さない。
+
+#define DEAD_LOOKAHEAD 64  // 上書きする代入を探す文の数
+
+typedef struct {
+  int from;
+  int to;
+} DeadEdge;
+
+static DeadEdge* dead_edges;
+static size_t dead_edges_len;
+static size_t dead_edges_cap;
+static bool* binding_useful;  // 値が観測されうる
+static bool* binding_kept;    // 宣言を消せない（式の中での代入など）
+static Env* dead_poisoned;    // 束縛が分からない読み出しのあった名前
+static bool dead_too_deep;
+static bool keep_globals = false;
+static bool dump_dead = false;
+
+static void dead_edge(int from, int to) {
+  if (dead_edges_len == dead_edges_cap) {
+    dead_edges_cap = dead_edges_cap ? dead_edges_cap * 2 : 256;
+    dead_edges = realloc(dead_edges, dead_edges_cap * sizeof(DeadEdge));
+    if (!dead_edges) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  dead_edges[dead_edges_len++] = (DeadEdge){from, to};
+}
+
+// 束縛が分からない読み出しは、同じ名前の変数すべてを読みうる。
+// 名前だけ覚えておき、dead_propagateで一度にまとめて印を付ける
+static void dead_poison(char* name) {
+  env_define(dead_poisoned, name, value_bool(true));
+}
+
+// 副作用も実行時エラーもなく評価できる式か
+static bool is_pure(Node* node, int depth) {
+  if (depth > OPT_MAX_DEPTH) return false;
+
+  switch (node->kind) {
+    case ND_NUM:
+    case ND_STR:
+    case ND_BOOL:
+    case ND_NIL:
+      return true;
+    case ND_IDENTIFIER:
+      return node->slot >= 0;
+    case ND_INVARIANT:
+      return is_pure(node->lhs, depth + 1);
+    case ND_NEG:
+      return is_pure(node->lhs, depth + 1) && infer_expr(node->lhs, 0) == TY_NUM;
+    case ND_ADD: {
+      if (!is_pure(node->lhs, depth + 1) || !is_pure(node->rhs, depth + 1)) {
+        return false;
+      }
+      Type l = infer_expr(node->lhs, 0);
+      return l == infer_expr(node->rhs, 0) && (l == TY_NUM || l == TY_STR);
+    }
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV:
+      return is_pure(node->lhs, depth + 1) && is_pure(node->rhs, depth + 1) &&
+             infer_expr(node->lhs, 0) == TY_NUM &&
+             infer_expr(node->rhs, 0) == TY_NUM;
+    case ND_BANG:
+      return is_pure(node->lhs, depth + 1);
+    case ND_LT:
+    case ND_LE:
+    case ND_EQ:
+    case ND_NE:
+    case ND_AND:
+    case ND_OR:
+      return is_pure(node->lhs, depth + 1) && is_pure(node->rhs, depth + 1);
+    default:
+      return false;
+  }
+}
+
+// 式の中の読み出しを集める。fromが束縛なら「fromが観測されるなら観測される」、
+// -1なら値がそのまま観測される
+static void dead_reads(Node* node, int from, int depth) {
+  if (!node) return;
+  if (depth > OPT_MAX_DEPTH) {
+    dead_too_deep = true;
+    return;
+  }
+
+  switch (node->kind) {
+    case ND_IDENTIFIER:
+      if (node->slot < 0) {
+        dead_poison(node->sval);
+      } else if (from >= 0) {
+        dead_edge(from, node->slot);
+      } else {
+        binding_useful[node->slot] = true;
+      }
+      return;
+    case ND_ASSIGN:
+      if (node->slot >= 0) binding_kept[node->slot] = true;
+      dead_reads(node->rhs, -1, depth + 1);
+      return;
+    case ND_INCREMENT:
+      if (node->slot >= 0) {
+        binding_kept[node->slot] = true;
+        binding_useful[node->slot] = true;
+      }
+      return;
+    default:
+      dead_reads(node->lhs, from, depth + 1);
+      dead_reads(node->rhs, from, depth + 1);
+  }
+}
+
+// 束縛bへの代入（宣言）の右辺
+static void dead_store_reads(int b, Node* rhs) {
+  if (rhs) dead_reads(rhs, is_pure(rhs, 0) ? b : -1, 0);
+}
+
+// frozen: ベクトル化したループの元の本体。名前で参照されるので何も消さない
+static void dead_collect(Node* node, bool frozen, int depth) {
+  if (!node) return;
+  if (depth > OPT_MAX_DEPTH) {
+    dead_too_deep = true;
+    return;
+  }
+
+  switch (node->kind) {
+    case ND_PROGRAM:
+    case ND_BLOCK:
+      for (Node* s = node->lhs; s != NULL; s = s->next) {
+        dead_collect(s, frozen, depth + 1);
+      }
+      return;
+    case ND_DECLARATION:
+      if (frozen) {
+        binding_kept[node->slot] = true;
+        dead_reads(node->lhs, -1, 0);
+      } else {
+        dead_store_reads(node->slot, node->lhs);
+      }
+      return;
+    case ND_EXPR_STMT: {
+      Node* e = node->lhs;
+      if (!frozen && e->kind == ND_ASSIGN && e->slot >= 0) {
+        dead_store_reads(e->slot, e->rhs);
+      } else if (!frozen && e->kind == ND_INCREMENT && e->slot >= 0) {
+        // 数値でなければ実行時エラーになるので残す
+        if (bindings[e->slot].type != TY_NUM) binding_kept[e->slot] = true;
+      } else {
+        dead_reads(e, -1, 0);
+        if (e->kind == ND_ASSIGN && e->slot >= 0) binding_kept[e->slot] = true;
+      }
+      return;
+    }
+    case ND_PRINT_STMT:
+      dead_reads(node->lhs, -1, 0);
+      return;
+    case ND_IF:
+      dead_reads(node->lhs, -1, 0);
+      dead_collect(node->rhs, frozen, depth + 1);
+      dead_collect(node->alt, frozen, depth + 1);
+      return;
+    case ND_WHILE:
+      dead_reads(node->lhs, -1, 0);
+      dead_collect(node->rhs, frozen, depth + 1);
+      return;
+    case ND_REDUCE:
+      dead_collect(node->lhs, true, depth + 1);
+      return;
+    default:
+      dead_reads(node, -1, 0);
+  }
+}
+
+// 観測される束縛から、その値を作るのに読んだ束縛へ広げる
+static void dead_propagate() {
+  size_t n = bindings_len;
+  size_t* start = calloc(n + 1, sizeof(size_t));
+  int* adj = malloc((dead_edges_len ? dead_edges_len : 1) * sizeof(int));
+  int* queue = malloc((n ? n : 1) * sizeof(int));
+  for (size_t i = 0; i < dead_edges_len; ++i) start[dead_edges[i].from + 1]++;
+  for (size_t i = 0; i < n; ++i) start[i + 1] += start[i];
+  size_t* fill = malloc((n ? n : 1) * sizeof(size_t));
+  memcpy(fill, start, n * sizeof(size_t));
+  for (size_t i = 0; i < dead_edges_len; ++i) {
+    adj[fill[dead_edges[i].from]++] = dead_edges[i].to;
+  }
+
+  size_t head = 0, tail = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (env_lookup(dead_poisoned, bindings[i].name)) binding_useful[i] = true;
+    if (binding_useful[i]) queue[tail++] = (int)i;
+  }
+  while (head < tail) {
+    int b = queue[head++];
+    for (size_t k = start[b]; k < start[b + 1]; ++k) {
+      if (!binding_useful[adj[k]]) {
+        binding_useful[adj[k]] = true;
+        queue[tail++] = adj[k];
+      }
+    }
+  }
+  free(start);
+  free(adj);
+  free(queue);
+  free(fill);
+}
+
+static bool removable(int b) {
+  if (b < 0 || binding_useful[b] || binding_kept[b]) return false;
+  return !(keep_globals && bindings[b].depth == 0);
+}
+
+// nameを読み書きする識別子を含むか。深すぎれば含むとみなす
+static bool mentions(Node* node, char* name, int depth) {
+  if (!node) return false;
+  if (depth > OPT_MAX_DEPTH) return true;
+
+  switch (node->kind) {
+    case ND_IDENTIFIER:
+    case ND_DECLARATION:
+    case ND_INCREMENT:
+      if (strcmp(node->sval, name) == 0) return true;
+      break;
+    case ND_PROGRAM:
+    case ND_BLOCK:
+      for (Node* s = node->lhs; s != NULL; s = s->next) {
+        if (mentions(s, name, depth + 1)) return true;
+      }
+      return false;
+    case ND_IF:
+      if (mentions(node->alt, name, depth + 1)) return true;
+      break;
+    default:
+      break;
+  }
+  return mentions(node->lhs, name, depth + 1) ||
+         mentions(node->rhs, name, depth + 1);
+}
+
+static bool is_root_store(Node* s) {
+  return s->kind == ND_EXPR_STMT && s->lhs->kind == ND_ASSIGN && s->lhs->slot >= 0;
+}
+
+// 同じ並びの後ろで、読まれる前に上書きされる代入か
+static bool overwritten(Node* s) {
+  Node* assign = s->lhs;
+  char* name = assign->lhs->sval;
+  int n = 0;
+  for (Node* t = s->next; t != NULL && n < DEAD_LOOKAHEAD; t = t->next, ++n) {
+    if (is_root_store(t) && t->lhs->slot == assign->slot) {
+      return !mentions(t->lhs->rhs, name, 0);
+    }
+    if (mentions(t, name, 0)) return false;
+  }
+  return false;
+}
+
+static void dead_report(Node* s, char* what, char* name, char* why, bool kept) {
+  if (dump_dead) {
+    fprintf(stderr, "line %d: removed %s of %s (%s%s)\n", s->line, what, name,
+            why, kept ? ", expression kept" : "");
+  }
+}
+
+// 宣言や代入を消す。右辺に副作用や実行時エラーの可能性があれば式文として残し、
+// 文ごと消してよければtrueを返す
+static bool dead_remove(Node* s, char* what, char* name, char* why, Node* rhs) {
+  bool keep = rhs && !is_pure(rhs, 0);
+  dead_report(s, what, name, why, keep);
+  if (!keep) return true;
+  s->kind = ND_EXPR_STMT;
+  s->lhs = rhs;
+  return false;
+}
+
+// 文を消すならtrueを返す（右辺を残す場合はその場で式文に書き換えてfalse）
+static bool dead_stmt(Node* s, bool in_list) {
+  switch (s->kind) {
+    case ND_DECLARATION:
+      if (!removable(s->slot)) return false;
+      stats.dead_decls++;
+      return dead_remove(s, "declaration", s->sval, "unused", s->lhs);
+    case ND_EXPR_STMT: {
+      Node* e = s->lhs;
+      if (e->kind == ND_INCREMENT && removable(e->slot)) {
+        stats.dead_stores++;
+        return dead_remove(s, "store", e->sval, "unused", NULL);
+      }
+      if (e->kind != ND_ASSIGN || e->slot < 0) return false;
+      if (removable(e->slot)) {
+        stats.dead_stores++;
+        return dead_remove(s, "store", e->lhs->sval, "unused", e->rhs);
+      }
+      if (in_list && overwritten(s)) {
+        stats.dead_stores++;
+        return dead_remove(s, "store", e->lhs->sval, "overwritten", e->rhs);
+      }
+      return false;
+    }
+    default:
+      return false;
+  }
+}
+
+static void dead_sweep(Node* node, int depth);
+
+// if/whileの本体のように並びでない位置の文は、消すならnilの式文にする
+static void dead_sweep_single(Node* s, int depth) {
+  if (!s) return;
+  if (dead_stmt(s, false)) {
+    s->kind = ND_EXPR_STMT;
+    s->lhs = new_node_nil();
+    return;
+  }
+  dead_sweep(s, depth + 1);
+}
+
+static void dead_sweep(Node* node, int depth) {
+  if (!node || depth > OPT_MAX_DEPTH) return;
+
+  switch (node->kind) {
+    case ND_PROGRAM:
+    case ND_BLOCK: {
+      Node** link = &node->lhs;
+      while (*link) {
+        Node* s = *link;
+        if (dead_stmt(s, true)) {
+          *link = s->next;
+          continue;
+        }
+        dead_sweep(s, depth + 1);
+        link = &s->next;
+      }
+      return;
+    }
+    case ND_IF:
+      dead_sweep_single(node->rhs, depth);
+      dead_sweep_single(node->alt, depth);
+      return;
+    case ND_WHILE:
+      dead_sweep_single(node->rhs, depth);
+      return;
+    default:
+      return;
+  }
+}
+
+static void eliminate_dead(Node* program) {
+  binding_useful = calloc(bindings_len + 1, sizeof(bool));
+  binding_kept = calloc(bindings_len + 1, sizeof(bool));
+  dead_edges_len = 0;
+  dead_too_deep = false;
+  dead_poisoned = env_push(NULL);
+
+  dead_collect(program, false, 0);
+  if (dump_dead) fprintf(stderr, "--- dead code ---\n");
+  if (!dead_too_deep) {
+    dead_propagate();
+    dead_sweep(program, 0);
+  }
+
+  env_pop(dead_poisoned);
+  dead_poisoned = NULL;
+  free(binding_useful);
+  free(binding_kept);
+  binding_useful = binding_kept = NULL;
+}
+
+typedef enum {
+  FK_CONST,
+  FK_VAR,
+  FK_INVARIANT,  // ループ不変式（loop_tempsの値を使う）
+  FK_NEG,
+  FK_ADD,
+  FK_SUB,
+  FK_MUL,
+  FK_DIV,
+  FK_LT,
+  FK_LE,
+  FK_GT,  // > / >= から作った比較。右辺を先に積むので、比べる向きが逆になる
+  FK_GE,
+  FK_EQ,
+  FK_NE,
+  FK_STORE,  // 数値の変数に書く（タグは書かない）
+  FK_GUARD,  // 数値と証明できない変数を読む。数値でなければ元の木で評価し直す
+} FexprOp;
+
+typedef struct {
+  FexprOp op;
+  double num;  // FK_CONSTの値
+  char* name;     // FK_VAR, FK_STOREの変数名
+  uint32_t hash;  // nameのハッシュ
+  Node* node;     // FK_INVARIANTのノード
+} FexprInsn;
+
+#define FEXPR_MAX_STACK (OPT_MAX_DEPTH + 2)
+
+#define FEXPR_MAX_DEOPTS 8  // これだけ確かめに失敗したら元の木だけで評価する
+
+typedef struct {
+  FexprInsn* code;
+  size_t len;
+  size_t cap;
+  bool boolean;  // 比較なので結果は真偽値
+  Node* origin;  // FK_GUARDで失敗したときに評価する元の式
+  size_t deopts;
+} Fexpr;
+
+static Fexpr* fexprs;
+static size_t fexprs_len;
+static size_t fexprs_cap;
+
+static void fexpr_emit(Fexpr* f, FexprOp op, double num, char* name, Node* node) {
+  if (f->len == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 8;
+    f->code = realloc(f->code, f->cap * sizeof(FexprInsn));
+  }
+  f->code[f->len++] = (FexprInsn){op, num, name, name ? hash_string(name) : 0, node};
+}
+
+static bool is_num_binding(int id) { return id >= 0 && bindings[id].type == TY_NUM; }
+
+// specialize_exprで数値だけと分かった式を後置記法にする。深さはそこで抑えてある
+static void fexpr_compile(Fexpr* f, Node* node) {
+  switch (node->kind) {
+    case ND_NUM:
+      fexpr_emit(f, FK_CONST, node->val, NULL, NULL);
+      return;
+    case ND_IDENTIFIER:
+      fexpr_emit(f, is_num_binding(node->slot) ? FK_VAR : FK_GUARD, 0, node->sval,
+                 NULL);
+      return;
+    case ND_INVARIANT:
+      fexpr_emit(f, FK_INVARIANT, 0, NULL, node);
+      return;
+    case ND_NEG:
+      fexpr_compile(f, node->lhs);
+      fexpr_emit(f, FK_NEG, 0, NULL, NULL);
+      return;
+    case ND_ASSIGN:
+      fexpr_compile(f, node->rhs);
+      fexpr_emit(f, FK_STORE, 0, node->lhs->sval, NULL);
+      return;
+    default: {
+      if (is_swapped(node)) {
+        fexpr_compile(f, node->rhs);
+        fexpr_compile(f, node->lhs);
+        fexpr_emit(f, node->kind == ND_LT ? FK_GT : FK_GE, 0, NULL, NULL);
+        return;
+      }
+      fexpr_compile(f, node->lhs);
+      fexpr_compile(f, node->rhs);
+      FexprOp op = node->kind == ND_ADD     ? FK_ADD
+                   : node->kind == ND_MINUS ? FK_SUB
+                   : node->kind == ND_MUL   ? FK_MUL
+                   : node->kind == ND_DIV   ? FK_DIV
+                   : node->kind == ND_LT    ? FK_LT
+                   : node->kind == ND_LE    ? FK_LE
+                   : node->kind == ND_EQ    ? FK_EQ
+                                            : FK_NE;
+      fexpr_emit(f, op, 0, NULL, NULL);
+      return;
+    }
+  }
+}
+
+// 葉だけの式は包んでも速くならない
+static void wrap_fexpr(Node** slot) {
+  NodeKind kind = (*slot)->kind;
+  if (kind == ND_NUM || kind == ND_IDENTIFIER || kind == ND_INVARIANT) return;
+
+  Fexpr f = {.boolean = kind == ND_LT || kind == ND_LE || kind == ND_EQ ||
+                        kind == ND_NE,
+             .origin = *slot};
+  fexpr_compile(&f, *slot);
+  for (size_t i = 0; i < f.len; ++i) {
+    if (f.code[i].op == FK_GUARD) {
+      stats.profile_speculated++;
+      break;
+    }
+  }
+
+  if (fexprs_len == fexprs_cap) {
+    fexprs_cap = fexprs_cap ? fexprs_cap * 2 : 64;
+    fexprs = realloc(fexprs, fexprs_cap * sizeof(Fexpr));
+    if (!fexprs) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  fexprs[fexprs_len] = f;
+
+  Node* node = new_node(ND_FEXPR, *slot, NULL);
+  node->slot = (int)fexprs_len++;
+  *slot = node;
+}
+
+static void specialize_root(Node** slot, bool writable, int depth);
+
+// プロファイルでいつも数値だった演算（PGO_NUMERIC）の子では、数値と証明できない
+// 変数もFK_GUARDで読むことにして数値とみなす。FK_GUARDで失敗すると式全体を
+// 評価し直すので、FK_STOREと同じ命令列には入れない。
+static bool spec_next;       // 次のspecialize_exprで変数を推測してよい
+static size_t spec_guards;   // 推測した変数の数
+static size_t spec_stores;   // 命令列に入れた代入の数
+
+static bool may_be_num(int id) {
+  return id < 0 || bindings[id].type == TY_ANY || bindings[id].type == TY_NONE;
+}
+
+// 部分式が数値だけで計算できるならtrueを返す。包むかどうかは親が決める。
+// 比較は結果が真偽値なので、子がどちらも数値ならその場で包む。
+// writableは*slotを書き換えてよいか（持ち主が共有されたノードでないか）。
+static bool specialize_expr(Node** slot, bool writable, int depth) {
+  Node* node = *slot;
+  bool speculate = spec_next;
+  spec_next = false;
+  if (depth > OPT_MAX_DEPTH) return false;
+  bool own = !node->shared;  // 自分の子を書き換えてよいか
+
+  switch (node->kind) {
+    case ND_NUM:
+      return true;
+
+    case ND_IDENTIFIER:
+      if (is_num_binding(node->slot)) return true;
+      if (!speculate || !may_be_num(node->slot)) return false;
+      spec_guards++;
+      return true;
+
+    case ND_INVARIANT: {
+      // 不変式は元の木で評価するので、推測した変数を含むなら中だけを包む
+      size_t guards = spec_guards;
+      bool inner = specialize_expr(&node->lhs, true, depth + 1);
+      if (inner && spec_guards > guards) {
+        wrap_fexpr(&node->lhs);
+        return false;
+      }
+      return inner;
+    }
+
+    case ND_NEG:
+      spec_next = node->pgo & PGO_NUMERIC;
+      return specialize_expr(&node->lhs, own, depth + 1);
+
+    case ND_ADD:
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_LT:
+    case ND_LE:
+    case ND_EQ:
+    case ND_NE: {
+      size_t guards = spec_guards;
+      size_t stores = spec_stores;
+      spec_next = node->pgo & PGO_NUMERIC;
+      bool lhs = specialize_expr(&node->lhs, own, depth + 1);
+      spec_next = node->pgo & PGO_NUMERIC;
+      bool rhs = specialize_expr(&node->rhs, own, depth + 1);
+      bool compare = node->kind != ND_ADD && node->kind != ND_MINUS &&
+                     node->kind != ND_MUL && node->kind != ND_DIV;
+      // 推測した変数と代入が左右に分かれていたら、まとめずに別々に包む
+      if (lhs && rhs && spec_guards > guards && spec_stores > stores) {
+        if (own) {
+          wrap_fexpr(&node->lhs);
+          wrap_fexpr(&node->rhs);
+        }
+        return false;
+      }
+      if (lhs && rhs && !compare) return true;
+      if (lhs && rhs) {
+        if (writable) wrap_fexpr(slot);
+        return false;
+      }
+      if (!own) return false;
+      if (lhs) wrap_fexpr(&node->lhs);
+      if (rhs) wrap_fexpr(&node->rhs);
+      return false;
+    }
+
+    case ND_ASSIGN: {
+      size_t guards = spec_guards;
+      bool rhs = specialize_expr(&node->rhs, true, depth + 1);
+      if (rhs && is_num_binding(node->slot) && spec_guards == guards) {
+        spec_stores++;
+        return true;
+      }
+      if (rhs) wrap_fexpr(&node->rhs);
+      return false;
+    }
+
+    case ND_ARRAY:
+      for (Node* a = node->lhs; a != NULL; a = a->rhs) {
+        specialize_root(&a->lhs, true, depth + 1);
+      }
+      return false;
+
+    case ND_CALL:
+      specialize_root(&node->lhs, true, depth + 1);
+      for (Node* a = node->rhs; a != NULL; a = a->rhs) {
+        specialize_root(&a->lhs, true, depth + 1);
+      }
+      return false;
+
+    case ND_INCREMENT:
+      return false;
+
+    default:
+      if (node->lhs) specialize_root(&node->lhs, own, depth + 1);
+      if (node->rhs) specialize_root(&node->rhs, own, depth + 1);
+      return false;
+  }
+}
+
+static void specialize_root(Node** slot, bool writable, int depth) {
+  if (*slot && specialize_expr(slot, writable, depth) && writable) {
+    wrap_fexpr(slot);
+  }
+}
+
+static void specialize_stmt(Node* node, int depth) {
+  if (!node || depth > OPT_MAX_DEPTH) return;
+
+  switch (node->kind) {
+    case ND_PROGRAM:
+    case ND_BLOCK:
+      for (Node* s = node->lhs; s != NULL; s = s->next) {
+        specialize_stmt(s, depth + 1);
+      }
+      return;
+    case ND_EXPR_STMT:
+    case ND_PRINT_STMT:
+    case ND_DECLARATION:
+      specialize_root(&node->lhs, true, 0);
+      return;
+    case ND_IF:
+      specialize_root(&node->lhs, true, 0);
+      specialize_stmt(node->rhs, depth + 1);
+      specialize_stmt(node->alt, depth + 1);
+      return;
+    case ND_WHILE:
+      specialize_root(&node->lhs, true, 0);
+      specialize_stmt(node->rhs, depth + 1);
+      return;
+    case ND_REDUCE:
+      specialize_stmt(node->lhs, depth + 1);
+      return;
+    default:
+      return;
+  }
+}
+
+static void print_types(size_t fexprs_before) {
+  size_t numeric = 0;
+  fprintf(stderr, "--- types ---\n");
+  for (size_t i = 0; i < bindings_len; ++i) {
+    fprintf(stderr, "%-12s %-8s depth %d\n", bindings[i].name,
+            type_names[bindings[i].type], bindings[i].depth);
+    if (bindings[i].type == TY_NUM) numeric++;
+  }
+  fprintf(stderr, "variables: %zu, numeric: %zu, numeric expressions: %zu\n",
+          bindings_len, numeric, fexprs_len - fexprs_before);
+}
+
+// 変数を解決し、型が変わらなくなるまで推論する。木が深すぎればfalse
+static bool infer_bindings(Node* program) {
+  bindings_len = 0;
+  type_too_deep = false;
+  type_scope = env_push(NULL);
+  type_depth = 0;
+  resolve_stmt(program, 0);
+  env_pop(type_scope);
+  type_scope = NULL;
+
+  if (!type_too_deep) {
+    do {
+      type_changed = false;
+      infer_stmt(program, 0);
+    } while (type_changed);
+  }
+  return !type_too_deep;
+}
+
+static void infer_types(Node* program) {
+  if (!infer_bindings(program)) {
+    if (dump_types) fprintf(stderr, "--- types ---\n(木が深すぎるため推論しません)\n");
+    return;
+  }
+
+  eliminate_dead(program);
+
+  size_t fexprs_before = fexprs_len;
+  specialize_stmt(program, 0);
+  if (dump_types) print_types(fexprs_before);
+}
+
+// --- 標準入力の行読み ---
+// read()で大きなブロックにまとめて読み、memchrで改行を探す。返す行は改行を'\0'に
+// 置き換えたブロックの中をそのまま指すので、1行ごとの確保もコピーもない。
+// ブロックが埋まったら読みかけの行だけを新しいブロックに移す。行の長さに上限はない。
+//
+// 古いブロックは、どの値からも指されなくなったら解放する。行を長く持てるのは変数
+// だけなので、env_define・env_assign・env_popでブロックごとに指している数を数える。
+// 式の途中の値（評価のスタックにある行）は数えない代わりに、その行より後に
+// paren_count行以上読むまでブロックを残す。式にはループがないので、1つの式が
+// 終わるまでに読む行は、式の中の呼び出しの数（(の数以下）を超えない。
+// 使う量は入力の大きさではなく、変数が持っている行と、この分の行で決まる。
+
+#define LINE_BLOCK_SIZE (1 << 20)
+
+typedef struct LineBlock LineBlock;
+
+struct LineBlock {
+  char* buf;
+  size_t cap;
+  size_t refs;         // このブロックの中を指している変数の数
+  uint64_t last_line;  // このブロックから最後に返した行の番号
+  LineBlock* next;
+};
+
+static LineBlock* line_blocks;  // まだ解放していないブロック
+static uint64_t lines_read;     // これまでに返した行の数
+
+static void line_ref(Value v, int delta) {
+  if (v.type != VAL_STRING || !line_blocks) return;
+  uintptr_t p = (uintptr_t)v.str;
+  for (LineBlock* b = line_blocks; b != NULL; b = b->next) {
+    if (p >= (uintptr_t)b->buf && p < (uintptr_t)b->buf + b->cap) {
+      b->refs += delta;
+      return;
+    }
+  }
+}
+
+// 読んでいるブロックのほかに、解放できるものを解放する
+static void line_blocks_sweep(LineBlock* current) {
+  for (LineBlock** link = &line_blocks; *link != NULL;) {
+    LineBlock* b = *link;
+    if (b != current && b->refs == 0 && lines_read - b->last_line >= paren_count) {
+      *link = b->next;
+      free(b->buf);
+      free(b);
+      continue;
+    }
+    link = &b->next;
+  }
+}
+
+typedef struct {
+  int fd;
+  LineBlock* block;  // 読んでいるブロック
+  char* buf;
+  size_t cap;
+  size_t start;    // まだ返していない部分の先頭
+  size_t scanned;  // 改行がないと分かっている位置
+  size_t end;      // 読んだデータの終わり
+  bool eof;
+  bool ranged;  // fdの[offset, limit)だけをpreadで読む（--shards）
+  off_t offset;
+  off_t limit;
+} LineReader;
+
+static LineReader stdin_reader = {.fd = STDIN_FILENO};
+
+// 改行を除いた1行を返す。入力が尽きたらNULL
+static char* read_line(LineReader* r) {
+  for (;;) {
+    char* nl = r->end > r->scanned
+                   ? memchr(r->buf + r->scanned, '\n', r->end - r->scanned)
+                   : NULL;
+    if (nl) {
+      *nl = '\0';
+      char* line = r->buf + r->start;
+      r->start = r->scanned = nl - r->buf + 1;
+      r->block->last_line = ++lines_read;
+      return line;
+    }
+    r->scanned = r->end;
+
+    if (r->eof) {
+      if (r->start == r->end) return NULL;
+      r->buf[r->end] = '\0';  // 末尾の改行のない行（'\0'の分は空けてある）
+      char* line = r->buf + r->start;
+      r->start = r->scanned = r->end;
+      r->block->last_line = ++lines_read;
+      return line;
+    }
+
+    if (r->end + 1 >= r->cap) {
+      size_t rest = r->end - r->start;
+      size_t cap = LINE_BLOCK_SIZE;
+      while (cap < rest * 2 + 1) cap *= 2;
+      char* buf = (char*)malloc(cap);
+      LineBlock* block = (LineBlock*)calloc(1, sizeof(LineBlock));
+      stats_alloc(ALLOC_INPUT, cap);
+      if (!buf || !block) {
+        fprintf(stderr, "メモリ確保に失敗しました。\n");
+        exit(74);
+      }
+      if (rest) memcpy(buf, r->buf + r->start, rest);
+      *block = (LineBlock){.buf = buf, .cap = cap, .next = line_blocks};
+      line_blocks = block;
+      r->block = block;
+      r->buf = buf;
+      r->cap = cap;
+      r->start = 0;
+      r->scanned = r->end = rest;
+      line_blocks_sweep(block);
+    }
+
+    size_t want = r->cap - r->end - 1;
+    ssize_t n;
+    if (r->ranged) {
+      if ((off_t)want > r->limit - r->offset) want = r->limit - r->offset;
+      n = want ? pread(r->fd, r->buf + r->end, want, r->offset) : 0;
+    } else {
+      n = read(r->fd, r->buf + r->end, want);
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      perror("read");
+      exit(EX_IOERR);
+    }
+    if (n == 0) r->eof = true;
+    r->end += n;
+    r->offset += n;
+  }
+}
+
+static Value native_readLine(Value* args, int argc) {
+  (void)args;
+  (void)argc;
+  char* line = read_line(&stdin_reader);
+  return line ? value_str(line) : value_nil();
+}
+
+// 組み込み関数をグローバル環境（--greenではタスクごとの環境）に登録する。
+// スクリプトで同じ名前の変数を定義すれば上書きできる。スナップショットから
+// 読んだ環境では、スクリプトが上書きした名前はそのままにしておく。
+static void define_natives(Env* env) {
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i) {
+    if (env->mapped && env_find(env, natives[i].name,
+                                hash_string(natives[i].name)) != NULL) {
+      continue;
+    }
+    env_define(env, natives[i].name,
+               (Value){.type = VAL_NATIVE, .native = &natives[i]});
+  }
+}
+
+static Value eval(Node* node);
+static char* profile_out;
+static void profile_count(Node* node, bool hit);
+
+static Value binary_op(NodeKind kind, Value lval, Value rval) {
+  switch (kind) {
+    case ND_ADD:
+      return add_values(lval, rval);
+    case ND_EQ:
+      return value_bool(is_equal(lval, rval));
+    case ND_NE:
+      return value_bool(!is_equal(lval, rval));
+    case ND_LT:
+      return value_bool(lval.num < rval.num);
+    case ND_LE:
+      return value_bool(lval.num <= rval.num);
+    default:
+      break;
+  }
+
+  expect_numbers(lval, rval);
+  switch (kind) {
+    case ND_MINUS:
+      return value_num(lval.num - rval.num);
+    case ND_MUL:
+      return value_num(lval.num * rval.num);
+    default:
+      return value_num(lval.num / rval.num);
+  }
+}
+
+static void assign_variable(char* name, Value v) {
+  if (!env_assign(current_env, name, v)) {
+    fprintf(stderr, "未定義の変数%sに代入しようとしました。\n", name);
+    fail(EX_DATAERR);
+  }
+}
+
+// --- 式の評価（明示的なスタック） ---
+// 演算子ノードは「どこまで子を評価したか」をフレームに持ってスタックに積み、
+// 子の値は値スタックに積む。500k項の x + x + ... + x でもCの再帰は起きない。
+// ネストしたevalからも使えるよう、呼び出しごとに積み始めた位置を覚えておく。
+
+typedef struct {
+  Node* node;
+  int state;     // 評価を終えた子の数
+  Node* cursor;  // ND_ARGの並びの次に評価するもの
+} EvalFrame;
+
+static EvalFrame* eval_frames;
+static size_t eval_frames_len;
+static size_t eval_frames_cap;
+
+static Value* eval_values;
+static size_t eval_values_len;
+static size_t eval_values_cap;
+
+static void eval_frame_push(Node* node) {
+  if (eval_frames_len == eval_frames_cap) {
+    eval_frames_cap = eval_frames_cap ? eval_frames_cap * 2 : 64;
+    eval_frames = realloc(eval_frames, eval_frames_cap * sizeof(EvalFrame));
+    if (!eval_frames) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  eval_frames[eval_frames_len++] = (EvalFrame){node, 0, NULL};
+}
+
+static void eval_value_push(Value v) {
+  if (eval_values_len == eval_values_cap) {
+    eval_values_cap = eval_values_cap ? eval_values_cap * 2 : 64;
+    eval_values = realloc(eval_values, eval_values_cap * sizeof(Value));
+    if (!eval_values) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  eval_values[eval_values_len++] = v;
+}
+
+static Value eval_value_pop() { return eval_values[--eval_values_len]; }
+
+// 型推論で数値と分かった部分式を、タグを見ずにdoubleのスタックで評価する
+static Value eval_fexpr(Fexpr* f) {
+  if (f->deopts >= FEXPR_MAX_DEOPTS) return eval(f->origin);
+  double stack[FEXPR_MAX_STACK];
+  size_t n = 0;
+  budget_left -= (long)f->len;
+
+  for (size_t k = 0; k < f->len; ++k) {
+    FexprInsn* in = &f->code[k];
+    switch (in->op) {
+      case FK_CONST:
+        stack[n++] = in->num;
+        break;
+      case FK_VAR:
+        stack[n++] = env_get_hash(current_env, in->name, in->hash).num;
+        break;
+      case FK_GUARD: {
+        // ここまでに副作用はないので、元の木で最初から評価し直せばよい
+        Entry* e = env_lookup_hash(current_env, in->name, in->hash);
+        if (e == NULL || e->value.type != VAL_NUM) {
+          f->deopts++;
+          stats.profile_deopts++;
+          return eval(f->origin);
+        }
+        stack[n++] = e->value.num;
+        break;
+      }
+      case FK_INVARIANT: {
+        LoopTemp* t = &loop_temps[in->node->slot];
+        stack[n++] = t->valid ? t->value.num : eval(in->node).num;
+        break;
+      }
+      case FK_NEG:
+        stack[n - 1] = -stack[n - 1];
+        break;
+      case FK_ADD:
+        n--;
+        stack[n - 1] += stack[n];
+        break;
+      case FK_SUB:
+        n--;
+        stack[n - 1] -= stack[n];
+        break;
+      case FK_MUL:
+        n--;
+        stack[n - 1] *= stack[n];
+        break;
+      case FK_DIV:
+        n--;
+        stack[n - 1] /= stack[n];
+        break;
+      case FK_LT:
+        n--;
+        stack[n - 1] = stack[n - 1] < stack[n];
+        break;
+      case FK_LE:
+        n--;
+        stack[n - 1] = stack[n - 1] <= stack[n];
+        break;
+      case FK_GT:
+        n--;
+        stack[n - 1] = stack[n - 1] > stack[n];
+        break;
+      case FK_GE:
+        n--;
+        stack[n - 1] = stack[n - 1] >= stack[n];
+        break;
+      case FK_EQ:
+        n--;
+        stack[n - 1] = stack[n - 1] == stack[n];
+        break;
+      case FK_NE:
+        n--;
+        stack[n - 1] = stack[n - 1] != stack[n];
+        break;
+      case FK_STORE: {
+        Entry* e = env_lookup_hash(current_env, in->name, in->hash);
+        if (e == NULL) {
+          fprintf(stderr, "未定義の変数%sに代入しようとしました。\n", in->name);
+          fail(EX_DATAERR);
+        }
+        e->value.num = stack[n - 1];
+        break;
+      }
+    }
+  }
+  return f->boolean ? value_bool(stack[0] != 0) : value_num(stack[0]);
+}
+
+// 葉はその場で値にし、それ以外はフレームを積む
+static void eval_child(Node* node) {
+  budget_left--;
+  switch (node->kind) {
+    case ND_NUM:
+      eval_value_push(value_num(node->val));
+      return;
+    case ND_STR:
+      eval_value_push(value_str(node->sval));
+      return;
+    case ND_BOOL:
+      eval_value_push(value_bool(node->bval));
+      return;
+    case ND_NIL:
+      eval_value_push(value_nil());
+      return;
+    case ND_IDENTIFIER:
+      eval_value_push(env_get(current_env, node->sval));
+      return;
+    case ND_INVARIANT:
+      if (loop_temps[node->slot].valid) {
+        eval_value_push(loop_temps[node->slot].value);
+        return;
+      }
+      eval_frame_push(node);
+      return;
+    case ND_FEXPR:
+      eval_value_push(eval_fexpr(&fexprs[node->slot]));
+      return;
+    default:
+      eval_frame_push(node);
+  }
+}
+
+static Value eval_expr(Node* root) {
+  size_t frame_base = eval_frames_len;
+  size_t value_base = eval_values_len;
+  eval_child(root);
+
+  while (eval_frames_len > frame_base) {
+    EvalFrame* f = &eval_frames[eval_frames_len - 1];
+    Node* node = f->node;
+
+    switch (node->kind) {
+      case ND_ADD:
+      case ND_MINUS:
+      case ND_MUL:
+      case ND_DIV:
+      case ND_EQ:
+      case ND_NE:
+      case ND_LT:
+      case ND_LE: {
+        bool rhs_first = is_swapped(node);
+        if (f->state == 0) {
+          f->state = 1;
+          eval_child(rhs_first ? node->rhs : node->lhs);
+          break;
+        }
+        if (f->state == 1) {
+          f->state = 2;
+          eval_child(rhs_first ? node->lhs : node->rhs);
+          break;
+        }
+        Value second = eval_value_pop();
+        Value first = eval_value_pop();
+        Value lval = rhs_first ? second : first;
+        Value rval = rhs_first ? first : second;
+        eval_frames_len--;
+        if (profile_out) {
+          profile_count(node, lval.type == VAL_NUM && rval.type == VAL_NUM);
+        }
+        eval_value_push(binary_op(node->kind, lval, rval));
+        break;
+      }
+
+      case ND_NEG:
+      case ND_BANG: {
+        if (f->state == 0) {
+          f->state = 1;
+          eval_child(node->lhs);
+          break;
+        }
+        Value val = eval_value_pop();
+        eval_frames_len--;
+        if (node->kind == ND_NEG) {
+          if (profile_out) profile_count(node, val.type == VAL_NUM);
+          eval_value_push(value_num(-val.num));
+        } else {
+          eval_value_push(value_bool(!is_truthy(val)));
+        }
+        break;
+      }
+
+      case ND_OR:
+      case ND_AND: {
+        if (f->state == 0) {
+          f->state = 1;
+          eval_child(node->lhs);
+          break;
+        }
+        if (f->state == 1) {
+          // 短絡したら左辺の値がそのまま結果
+          bool truthy = is_truthy(eval_values[eval_values_len - 1]);
+          if (truthy == (node->kind == ND_OR)) {
+            eval_frames_len--;
+            break;
+          }
+          eval_value_pop();
+          f->state = 2;
+          eval_child(node->rhs);
+          break;
+        }
+        eval_frames_len--;
+        break;
+      }
+
+      case ND_ASSIGN: {
+        if (f->state == 0) {
+          f->state = 1;
+          eval_child(node->rhs);
+          break;
+        }
+        assign_variable(node->lhs->sval, eval_values[eval_values_len - 1]);
+        eval_frames_len--;
+        break;
+      }
+
+      case ND_INDEX: {
+        if (f->state == 0) {
+          f->state = 1;
+          eval_child(node->lhs);
+          break;
+        }
+        if (f->state == 1) {
+          f->state = 2;
+          eval_child(node->rhs);
+          break;
+        }
+        Value index = eval_value_pop();
+        Value obj = eval_value_pop();
+        eval_frames_len--;
+        eval_value_push(value_num(array_get(obj, index)));
+        break;
+      }
+
+      case ND_SET_INDEX: {
+        if (f->state < 3) {
+          Node* child = f->state == 0   ? node->lhs->lhs
+                        : f->state == 1 ? node->lhs->rhs
+                                        : node->rhs;
+          f->state++;
+          eval_child(child);
+          break;
+        }
+        Value v = eval_value_pop();
+        Value index = eval_value_pop();
+        Value obj = eval_value_pop();
+        eval_frames_len--;
+        eval_value_push(array_set(obj, index, v));
+        break;
+      }
+
+      case ND_CALL:
+      case ND_ARRAY: {
+        // 呼び出し先と引数を値スタックに積み、その場所をそのまま関数に渡す
+        if (f->state == 0) {
+          f->state = 1;
+          if (node->kind == ND_CALL) {
+            f->cursor = node->rhs;
+            eval_child(node->lhs);
+            break;
+          }
+          f->cursor = node->lhs;
+        }
+        if (f->cursor) {
+          Node* arg = f->cursor;
+          f->cursor = arg->rhs;
+          f->state++;
+          eval_child(arg->lhs);
+          break;
+        }
+        int argc = f->state - 1;
+        Value* args = &eval_values[eval_values_len - argc];
+        Value result;
+        if (node->kind == ND_CALL) {
+          result = call_native(args[-1], args, argc);
+          eval_values_len--;
+        } else {
+          result = array_literal(args, argc);
+        }
+        eval_values_len -= argc;
+        eval_frames_len--;
+        eval_value_push(result);
+        break;
+      }
+
+      case ND_INVARIANT: {
+        if (f->state == 0) {
+          f->state = 1;
+          eval_child(node->lhs);
+          break;
+        }
+        loop_temps[node->slot].value = eval_values[eval_values_len - 1];
+        loop_temps[node->slot].valid = true;
+        eval_frames_len--;
+        break;
+      }
+
+      default:
+        eval_frames_len--;
+        eval_value_push(eval(node));
+        break;
+    }
+  }
+
+  Value result = eval_values[value_base];
+  eval_values_len = value_base;
+  return result;
+}
+
+// --- 総和ループの実行（SIMD） ---
+
+typedef struct {
+  void (*binop)(ReduceOp op, double* a, const double* b, size_t n);
+  void (*neg)(double* a, size_t n);
+  double (*sum)(const double* a, size_t n);  // 4本の部分和（--fast-math）
+} ReduceKernels;
+
+static void scalar_binop(ReduceOp op, double* a, const double* b, size_t n) {
+  for (size_t k = 0; k < n; ++k) {
+    switch (op) {
+      case RK_ADD:
+        a[k] = a[k] + b[k];
+        break;
+      case RK_SUB:
+        a[k] = a[k] - b[k];
+        break;
+      case RK_MUL:
+        a[k] = a[k] * b[k];
+        break;
+      default:
+        a[k] = a[k] / b[k];
+        break;
+    }
+  }
+}
+
+static void scalar_neg(double* a, size_t n) {
+  for (size_t k = 0; k < n; ++k) a[k] = -a[k];
+}
+
+static double scalar_sum(const double* a, size_t n) {
+  double s[4] = {0, 0, 0, 0};
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    for (int j = 0; j < 4; ++j) s[j] += a[k + j];
+  }
+  for (; k < n; ++k) s[k % 4] += a[k];
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+#if defined(__x86_64__)
+#define DEFINE_SIMD_REDUCE(ISA, VEC, WIDTH, LOAD, STORE, ADD, SUB, MUL, DIV,   \
+                           XOR, SET1, SETZERO)                                  \
+  static void ISA##_binop(ReduceOp op, double* a, const double* b, size_t n) { \
+    size_t k = 0;                                                               \
+    for (; k + WIDTH <= n; k += WIDTH) {                                        \
+      VEC x = LOAD(a + k);                                                      \
+      VEC y = LOAD(b + k);                                                      \
+      switch (op) {                                                             \
+        case RK_ADD:                                                            \
+          x = ADD(x, y);                                                        \
+          break;                                                                \
+        case RK_SUB:                                                            \
+          x = SUB(x, y);                                                        \
+          break;                                                                \
+        case RK_MUL:                                                            \
+          x = MUL(x, y);                                                        \
+          break;                                                                \
+        default:                                                                \
+          x = DIV(x, y);                                                        \
+          break;                                                                \
+      }                                                                         \
+      STORE(a + k, x);                                                          \
+    }                                                                           \
+    scalar_binop(op, a + k, b + k, n - k);                                      \
+  }                                                                             \
+                                                                                \
+  static void ISA##_neg(double* a, size_t n) {                                  \
+    VEC sign = SET1(-0.0);                                                      \
+    size_t k = 0;                                                               \
+    for (; k + WIDTH <= n; k += WIDTH) STORE(a + k, XOR(LOAD(a + k), sign));   \
+    scalar_neg(a + k, n - k);                                                   \
+  }                                                                             \
+                                                                                \
+  static double ISA##_sum(const double* a, size_t n) {                          \
+    VEC s = SETZERO();                                                          \
+    size_t k = 0;                                                               \
+    for (; k + WIDTH <= n; k += WIDTH) s = ADD(s, LOAD(a + k));                 \
+    double lanes[WIDTH];                                                        \
+    STORE(lanes, s);                                                            \
+    double total = 0;                                                           \
+    for (int j = 0; j < WIDTH; ++j) total += lanes[j];                          \
+    for (; k < n; ++k) total += a[k];                                           \
+    return total;                                                               \
+  }
+
+DEFINE_SIMD_REDUCE(sse2, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd,
+                   _mm_sub_pd, _mm_mul_pd, _mm_div_pd, _mm_xor_pd, _mm_set1_pd,
+                   _mm_setzero_pd)
+
+#pragma GCC push_options
+#pragma GCC target("avx")
+DEFINE_SIMD_REDUCE(avx, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd,
+                   _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd,
+                   _mm256_xor_pd, _mm256_set1_pd, _mm256_setzero_pd)
+#pragma GCC pop_options
+#endif
+
+static ReduceKernels reduce_kernels = {scalar_binop, scalar_neg, scalar_sum};
+
+static void reduce_init() {
+  static bool initialized = false;
+  if (initialized) return;
+  initialized = true;
+
+  if (getenv("ASARI_NO_SIMD")) return;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) {
+    reduce_kernels = (ReduceKernels){avx_binop, avx_neg, avx_sum};
+  } else {
+    reduce_kernels = (ReduceKernels){sse2_binop, sse2_neg, sse2_sum};
+  }
+#endif
+}
+
+// 条件を満たさない値があれば何もせずfalseを返し、元のループで実行させる
+static bool eval_reduction(Reduction* r) {
+  Entry* index = env_lookup(current_env, r->index);
+  Entry* acc = env_lookup(current_env, r->acc);
+  if (!index || !acc || index->value.type != VAL_NUM ||
+      acc->value.type != VAL_NUM) {
+    return false;
+  }
+  Value bound = eval(r->bound);
+  if (bound.type != VAL_NUM) return false;
+
+  double i = index->value.num;
+  bool first = r->inclusive ? i <= bound.num : i < bound.num;
+  if (!first) return true;  // 一度も回らない
+
+  for (size_t k = 0; k < r->len; ++k) {
+    if (r->code[k].op != RK_VAR) continue;
+    Entry* e = env_lookup(current_env, r->code[k].name);
+    if (!e || e->value.type != VAL_NUM) return false;
+    r->code[k].num = e->value.num;
+  }
+
+  reduce_init();
+  static double lanes[REDUCE_BLOCK];
+  double* stack = malloc(r->max_stack * REDUCE_BLOCK * sizeof(double));
+
+  for (;;) {
+    // i の値を逐次の加算で並べる（元のループと同じ値になる）
+    size_t n = 0;
+    while (n < REDUCE_BLOCK && (r->inclusive ? i <= bound.num : i < bound.num)) {
+      lanes[n++] = i;
+      i += r->step;
+    }
+    if (n == 0) break;
+
+    size_t sp = 0;
+    for (size_t k = 0; k < r->len; ++k) {
+      ReduceInsn* insn = &r->code[k];
+      double* top = stack + sp * REDUCE_BLOCK;
+      switch (insn->op) {
+        case RK_CONST:
+        case RK_VAR:
+          for (size_t j = 0; j < n; ++j) top[j] = insn->num;
+          sp++;
+          break;
+        case RK_INDEX:
+          memcpy(top, lanes, n * sizeof(double));
+          sp++;
+          break;
+        case RK_NEG:
+          reduce_kernels.neg(top - REDUCE_BLOCK, n);
+          break;
+        default:
+          reduce_kernels.binop(insn->op, top - 2 * REDUCE_BLOCK,
+                               top - REDUCE_BLOCK, n);
+          sp--;
+          break;
+      }
+    }
+
+    double* f = stack;
+    double total = acc->value.num;
+    if (fast_math) {
+      double s = reduce_kernels.sum(f, n);
+      total = r->subtract ? total - s : total + s;
+    } else if (r->subtract) {
+      for (size_t j = 0; j < n; ++j) total = total - f[j];
+    } else {
+      for (size_t j = 0; j < n; ++j) total = total + f[j];
+    }
+    acc->value.num = total;
+    index->value.num = i;
+
+    budget_left -= (long)(n * (r->len + 4));
+    if (budget_left <= 0) task_yield();
+  }
+
+  free(stack);
+  return true;
+}
+
+// 読み飛ばしておいた本体をパースし、ND_LAZYのノードをその場で置き換える。
+// 本体の中のif/whileもまた読み飛ばされるので、パースするのは実行する部分だけになる。
+static void parse_lazy(Node* node) {
+  phase_begin(PHASE_PARSE);
+  Token* saved = token;
+  token = node->start;
+  Node* body = statement();
+  token = saved;
+  phase_end(PHASE_PARSE);
+
+  Node* next = node->next;
+  *node = *body;
+  node->next = next;
+  stats.lazy_parsed++;
+
+  if (optimize) {
+    phase_begin(PHASE_OPT);
+    optimize_loops(node, 0);
+    phase_end(PHASE_OPT);
+  }
+}
+
+// --- サンプリングプロファイラ（--sample-profile[=hz]） ---
+// setitimer(ITIMER_PROF)で使ったCPU時間の1/hz秒ごとにSIGPROFを受け、その時点で
+// 実行中の文の入れ子（evalの呼び出しの並び）を固定長の表に数える。evalは
+// 呼ばれるたびに配列に1つ書くだけで、ハンドラは確保もロックもしない。
+// 表が埋まったら、入らなかったサンプルの数だけを数える。
+// 終了時にflamegraph.plなどが読める折り畳みスタック形式（1行が「枠;枠;... 回数」、
+// 枠は「ノードの種類:行番号」）で--sample-profile-outのファイルに書き出す。
+// 指定がなければPROF_OUTPUTにpidを入れた名前にして、同時に動く別の実行と重ならないようにする。
+
+#define PROF_STACK_MAX 1024   // これより深い呼び出しは記録しない
+#define PROF_MAX_FRAMES 32    // サンプルには内側からこの数だけ残す
+#define PROF_TABLE_SIZE 4096  // 2のべき乗
+#define PROF_OUTPUT "asari-lox.%d.folded"  // %dはpid
+
+typedef struct {
+  uint32_t hash;
+  int depth;
+  long count;
+  Node* frames[PROF_MAX_FRAMES];
+} ProfSample;
+
+static const char* node_kind_names[] = {
+    [ND_ADD] = "add",         [ND_MINUS] = "sub",
+    [ND_MUL] = "mul",         [ND_DIV] = "div",
+    [ND_NEG] = "neg",         [ND_LT] = "lt",
+    [ND_LE] = "le",           [ND_EQ] = "eq",
+    [ND_NE] = "ne",           [ND_BANG] = "not",
+    [ND_NUM] = "num",         [ND_STR] = "str",
+    [ND_BOOL] = "bool",       [ND_PRINT_STMT] = "print",
+    [ND_EXPR_STMT] = "expr",  [ND_PROGRAM] = "program",
+    [ND_DECLARATION] = "var", [ND_IDENTIFIER] = "ident",
+    [ND_ASSIGN] = "assign",   [ND_BLOCK] = "block",
+    [ND_IF] = "if",           [ND_OR] = "or",
+    [ND_AND] = "and",         [ND_WHILE] = "while",
+    [ND_NIL] = "nil",         [ND_INVARIANT] = "invariant",
+    [ND_INCREMENT] = "increment", [ND_REDUCE] = "reduce",
+    [ND_ARRAY] = "array",     [ND_INDEX] = "index",
+    [ND_SET_INDEX] = "setindex", [ND_CALL] = "call",
+    [ND_ARG] = "arg",         [ND_LAZY] = "lazy",
+    [ND_FEXPR] = "fexpr",
+};
+
+static int sample_hz = 0;
+static char* prof_out = NULL;  // --sample-profile-out
+// evalは書く順番だけをシグナルフェンスで守る（ハンドラは同じスレッドで割り込む）
+static Node* prof_stack[PROF_STACK_MAX];
+static int prof_depth;
+static ProfSample prof_samples[PROF_TABLE_SIZE];
+static volatile long prof_total;
+static volatile long prof_dropped;
+
+static void prof_handler(int sig) {
+  (void)sig;
+  int depth = prof_depth < PROF_STACK_MAX ? prof_depth : PROF_STACK_MAX;
+  int first = depth > PROF_MAX_FRAMES ? depth - PROF_MAX_FRAMES : 0;
+  int n = depth - first;
+  Node* frames[PROF_MAX_FRAMES];
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < n; ++i) {
+    frames[i] = prof_stack[first + i];
+    hash ^= (uint32_t)((uintptr_t)frames[i] >> 3);
+    hash *= 16777619u;
+  }
+  prof_total++;
+
+  size_t mask = PROF_TABLE_SIZE - 1;
+  for (size_t i = hash & mask, probes = 0; probes < PROF_TABLE_SIZE;
+       i = (i + 1) & mask, ++probes) {
+    ProfSample* s = &prof_samples[i];
+    if (s->count == 0) {
+      s->hash = hash;
+      s->depth = n;
+      memcpy(s->frames, frames, n * sizeof(Node*));
+      s->count = 1;
+      return;
+    }
+    if (s->hash == hash && s->depth == n &&
+        memcmp(s->frames, frames, n * sizeof(Node*)) == 0) {
+      s->count++;
+      return;
+    }
+  }
+  prof_dropped++;
+}
+
+static void prof_report() {
+  if (forked_child) return;
+  struct itimerval off = {0};
+  setitimer(ITIMER_PROF, &off, NULL);
+  fflush(stdout);
+
+  FILE* out = fopen(prof_out, "w");
+  if (!out) {
+    perror(prof_out);
+    return;
+  }
+  for (size_t i = 0; i < PROF_TABLE_SIZE; ++i) {
+    ProfSample* s = &prof_samples[i];
+    if (s->count == 0) continue;
+    if (s->depth == 0) fprintf(out, "(outside eval)");
+    for (int k = 0; k < s->depth; ++k) {
+      fprintf(out, "%s%s:%d", k ? ";" : "", node_kind_names[s->frames[k]->kind],
+              s->frames[k]->line);
+    }
+    fprintf(out, " %ld\n", s->count);
+  }
+  fclose(out);
+  fprintf(stderr, "sample profile: %ld samples at %d Hz (%ld dropped) -> %s\n",
+          prof_total, sample_hz, prof_dropped, prof_out);
+}
+
+static void prof_start() {
+  if (!prof_out) {
+    static char name[64];
+    snprintf(name, sizeof(name), PROF_OUTPUT, (int)getpid());
+    prof_out = name;
+  }
+
+  struct sigaction sa = {.sa_handler = prof_handler, .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+
+  long usec = 1000000L / sample_hz;
+  if (usec <= 0) usec = 1;
+  struct itimerval timer = {{usec / 1000000, usec % 1000000},
+                            {usec / 1000000, usec % 1000000}};
+  setitimer(ITIMER_PROF, &timer, NULL);
+  atexit(prof_report);
+}
+
+// --- プロファイルによる最適化（--write-profile / --use-profile） ---
+// --write-profileでは、パースした直後の木の演算（ND_ADDなど）・ND_IF・ND_WHILEを
+// サイトとして登録し、実行中に回数を数えて終了時にファイルへ書く。演算はオペランドが
+// どちらも数値だった回数、ND_IFは条件が真だった回数、ND_WHILEは入った回数と回った回数。
+// --use-profileでは、パースした直後の木に読み込んだ回数を当てはめて印を付ける。
+//   - 何度も実行され、いつも数値だった演算: 型推論で数値と証明できなくても、
+//     変数が数値であることを読むときに確かめる数値の命令列にする（確かめに失敗したら
+//     元の木で評価し直す）
+//   - ほとんどelseに進むif: 条件が!cかc == d / c != dなら、反転して本体を入れ替える
+//   - 何度も入るのにほとんど回らないループ: 不変式の巻き上げをしない
+// スクリプトが変わっても使えるよう、サイトは行番号・ノードの種類・部分木の形の
+// ハッシュで照らし合わせる。行がずれても、同じ形がプロファイルに1つしかなければ使う。
+
+#define PROFILE_HOT 1000        // これ以上実行された演算とifを使う
+#define PROFILE_MIN_ENTRIES 16  // これ以上入ったループを使う
+#define PROFILE_SHAPE_DEPTH 4   // 形のハッシュに含める深さ
+
+typedef struct {
+  int line;
+  NodeKind kind;
+  uint32_t shape;
+  uint64_t count;  // 実行した回数（ND_WHILEは入った回数）
+  uint64_t hits;   // 数値同士だった / 真だった / 回った回数
+} ProfileSite;
+
+static char* profile_out = NULL;
+static char* profile_in = NULL;
+
+// 記録するサイトと、ノードからサイトを引く表
+static ProfileSite* profile_sites;
+static size_t profile_sites_len;
+static size_t profile_sites_cap;
+static Node** profile_nodes;  // 開番地法。2のべき乗
+static int* profile_index;
+static size_t profile_table_cap;
+
+// 読み込んだサイト。exactは行・種類・形、looseは種類・形で引く（添字+1）。
+// looseで負の値は、同じ形が別の行にもあって決められないという印
+static ProfileSite* profile_loaded;
+static size_t profile_loaded_len;
+static int* profile_exact;
+static int* profile_loose;
+static size_t profile_loaded_cap;
+
+static bool profile_site_kind(NodeKind kind) {
+  switch (kind) {
+    case ND_ADD:
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_NEG:
+    case ND_LT:
+    case ND_LE:
+    case ND_EQ:
+    case ND_NE:
+    case ND_IF:
+    case ND_WHILE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static uint32_t shape_mix(uint32_t h, uint64_t v) {
+  h ^= (uint32_t)v ^ (uint32_t)(v >> 32);
+  return h * 16777619u;
+}
+
+// 部分木の形。ifとwhileは条件だけを見る（本体は書き換えられやすい）
+static uint32_t shape_hash(Node* node, int depth) {
+  if (!node) return 0x9e3779b9u;
+  uint32_t h = shape_mix(2166136261u, node->kind);
+  switch (node->kind) {
+    case ND_NUM: {
+      uint64_t bits;
+      memcpy(&bits, &node->val, sizeof(bits));
+      return shape_mix(h, bits);
+    }
+    case ND_STR:
+    case ND_IDENTIFIER:
+    case ND_DECLARATION:
+      return shape_mix(h, hash_string(node->sval));
+    case ND_BOOL:
+      return shape_mix(h, node->bval);
+    case ND_LAZY:
+      return h;
+    default:
+      break;
+  }
+  if (depth >= PROFILE_SHAPE_DEPTH) return h;
+  h = shape_mix(h, shape_hash(node->lhs, depth + 1));
+  if (node->kind == ND_IF || node->kind == ND_WHILE) return h;
+  return shape_mix(h, shape_hash(node->rhs, depth + 1));
+}
+
+static ProfileSite profile_key(Node* node) {
+  return (ProfileSite){node->line, node->kind, shape_hash(node, 0), 0, 0};
+}
+
+static size_t profile_ptr_hash(Node* node) {
+  uintptr_t p = (uintptr_t)node;
+  return (size_t)((p >> 3) * 0x9e3779b97f4a7c15ull >> 20);
+}
+
+static void profile_table_grow() {
+  size_t old_cap = profile_table_cap;
+  Node** old_nodes = profile_nodes;
+  int* old_index = profile_index;
+  profile_table_cap = old_cap ? old_cap * 2 : 1024;
+  profile_nodes = calloc(profile_table_cap, sizeof(Node*));
+  profile_index = calloc(profile_table_cap, sizeof(int));
+  if (!profile_nodes || !profile_index) {
+    fprintf(stderr, "メモリ確保に失敗しました。\n");
+    exit(74);
+  }
+  for (size_t i = 0; i < old_cap; ++i) {
+    if (!old_nodes[i]) continue;
+    size_t k = profile_ptr_hash(old_nodes[i]) & (profile_table_cap - 1);
+    while (profile_nodes[k]) k = (k + 1) & (profile_table_cap - 1);
+    profile_nodes[k] = old_nodes[i];
+    profile_index[k] = old_index[i];
+  }
+  free(old_nodes);
+  free(old_index);
+}
+
+static void profile_register(Node* node) {
+  if ((profile_sites_len + 1) * 2 > profile_table_cap) profile_table_grow();
+  size_t k = profile_ptr_hash(node) & (profile_table_cap - 1);
+  for (; profile_nodes[k]; k = (k + 1) & (profile_table_cap - 1)) {
+    if (profile_nodes[k] == node) return;  // ハッシュコンスで共有したノード
+  }
+
+  if (profile_sites_len == profile_sites_cap) {
+    profile_sites_cap = profile_sites_cap ? profile_sites_cap * 2 : 256;
+    profile_sites = realloc(profile_sites, profile_sites_cap * sizeof(ProfileSite));
+    if (!profile_sites) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  profile_sites[profile_sites_len] = profile_key(node);
+  profile_nodes[k] = node;
+  profile_index[k] = (int)profile_sites_len++;
+}
+
+static ProfileSite* profile_site(Node* node) {
+  if (!profile_table_cap) return NULL;
+  size_t k = profile_ptr_hash(node) & (profile_table_cap - 1);
+  for (; profile_nodes[k]; k = (k + 1) & (profile_table_cap - 1)) {
+    if (profile_nodes[k] == node) return &profile_sites[profile_index[k]];
+  }
+  return NULL;
+}
+
+// 評価から呼ぶ。パースした後に作られたノードは数えない
+static void profile_count(Node* node, bool hit) {
+  ProfileSite* site = profile_site(node);
+  if (site) {
+    site->count++;
+    site->hits += hit;
+  }
+}
+
+static void profile_walk(Node* node, void (*visit)(Node*), int depth) {
+  if (!node || depth > OPT_MAX_DEPTH) return;
+
+  switch (node->kind) {
+    case ND_PROGRAM:
+    case ND_BLOCK:
+      for (Node* s = node->lhs; s != NULL; s = s->next) {
+        profile_walk(s, visit, depth + 1);
+      }
+      return;
+    case ND_LAZY:
+      return;
+    default:
+      break;
+  }
+  if (profile_site_kind(node->kind)) visit(node);
+  profile_walk(node->lhs, visit, depth + 1);
+  profile_walk(node->rhs, visit, depth + 1);
+  if (node->kind == ND_IF) profile_walk(node->alt, visit, depth + 1);
+}
+
+static void profile_write() {
+  if (forked_child) return;
+
+  fflush(stdout);
+  FILE* fp = fopen(profile_out, "w");
+  if (!fp) {
+    fprintf(stderr, "プロファイルを書き出せませんでした: %s\n", profile_out);
+    return;
+  }
+  fprintf(fp, "# asari-lox profile: line kind shape count hits\n");
+  for (size_t i = 0; i < profile_sites_len; ++i) {
+    ProfileSite* s = &profile_sites[i];
+    fprintf(fp, "%d %s %08x %llu %llu\n", s->line, node_kind_names[s->kind],
+            s->shape, (unsigned long long)s->count, (unsigned long long)s->hits);
+  }
+  fclose(fp);
+}
+
+static size_t profile_exact_hash(ProfileSite* s) {
+  return (size_t)(s->shape ^ (uint32_t)s->line * 2654435761u ^ (uint32_t)s->kind << 24);
+}
+
+static size_t profile_loose_hash(ProfileSite* s) {
+  return (size_t)(s->shape ^ (uint32_t)s->kind << 24);
+}
+
+// 見つからなければ空きの位置を返す
+static size_t profile_probe(int* table, ProfileSite* key, bool exact) {
+  size_t mask = profile_loaded_cap - 1;
+  size_t k = (exact ? profile_exact_hash(key) : profile_loose_hash(key)) & mask;
+  for (; table[k]; k = (k + 1) & mask) {
+    if (table[k] < 0) {
+      // 曖昧の印も最初に見つけたサイトの添字を持っているので、形を比べられる
+      if (!exact) {
+        ProfileSite* s = &profile_loaded[-table[k] - 1];
+        if (s->kind == key->kind && s->shape == key->shape) return k;
+      }
+      continue;
+    }
+    ProfileSite* s = &profile_loaded[table[k] - 1];
+    if (s->kind == key->kind && s->shape == key->shape &&
+        (!exact || s->line == key->line)) {
+      return k;
+    }
+  }
+  return k;
+}
+
+static void profile_load(char* path) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "ファイルを開けませんでした: %s\n", path);
+    exit(EX_IOERR);
+  }
+
+  size_t cap = 0;
+  char buf[256];
+  while (fgets(buf, sizeof(buf), fp)) {
+    if (buf[0] == '#') continue;
+    int line;
+    char kind_name[32];
+    unsigned shape;
+    unsigned long long count, hits;
+    if (sscanf(buf, "%d %31s %x %llu %llu", &line, kind_name, &shape, &count,
+               &hits) != 5) {
+      fprintf(stderr, "プロファイルの形式が正しくありません: %s", buf);
+      exit(EX_DATAERR);
+    }
+    int kind = -1;
+    int kinds = (int)(sizeof(node_kind_names) / sizeof(node_kind_names[0]));
+    for (int k = 0; k < kinds; ++k) {
+      if (node_kind_names[k] && strcmp(node_kind_names[k], kind_name) == 0) kind = k;
+    }
+    if (kind < 0 || !profile_site_kind((NodeKind)kind)) continue;
+
+    if (profile_loaded_len == cap) {
+      cap = cap ? cap * 2 : 256;
+      profile_loaded = realloc(profile_loaded, cap * sizeof(ProfileSite));
+      if (!profile_loaded) {
+        fprintf(stderr, "メモリ確保に失敗しました。\n");
+        exit(74);
+      }
+    }
+    profile_loaded[profile_loaded_len++] =
+        (ProfileSite){line, (NodeKind)kind, shape, count, hits};
+  }
+  fclose(fp);
+
+  profile_loaded_cap = 64;
+  while (profile_loaded_cap < profile_loaded_len * 2) profile_loaded_cap *= 2;
+  profile_exact = calloc(profile_loaded_cap, sizeof(int));
+  profile_loose = calloc(profile_loaded_cap, sizeof(int));
+  if (!profile_exact || !profile_loose) {
+    fprintf(stderr, "メモリ確保に失敗しました。\n");
+    exit(74);
+  }
+
+  for (size_t i = 0; i < profile_loaded_len; ++i) {
+    ProfileSite* s = &profile_loaded[i];
+    size_t k = profile_probe(profile_exact, s, true);
+    if (profile_exact[k]) {
+      // 同じ行に同じ形が複数あれば足し合わせる
+      ProfileSite* dst = &profile_loaded[profile_exact[k] - 1];
+      dst->count += s->count;
+      dst->hits += s->hits;
+      continue;
+    }
+    profile_exact[k] = (int)i + 1;
+
+    k = profile_probe(profile_loose, s, false);
+    if (profile_loose[k] == 0) {
+      profile_loose[k] = (int)i + 1;
+    } else if (profile_loose[k] > 0) {
+      profile_loose[k] = -profile_loose[k];
+    }
+  }
+}
+
+static ProfileSite* profile_lookup(Node* node) {
+  ProfileSite key = profile_key(node);
+  size_t k = profile_probe(profile_exact, &key, true);
+  if (profile_exact[k]) return &profile_loaded[profile_exact[k] - 1];
+  k = profile_probe(profile_loose, &key, false);
+  if (profile_loose[k] > 0) return &profile_loaded[profile_loose[k] - 1];
+  return NULL;
+}
+
+// ifの条件を反転できるなら反転する（評価の回数は変えない）
+static bool flip_condition(Node* node) {
+  Node* cond = node->lhs;
+  if (cond->kind == ND_BANG) {
+    node->lhs = cond->lhs;
+  } else if ((cond->kind == ND_EQ || cond->kind == ND_NE) && !cond->shared) {
+    cond->kind = cond->kind == ND_EQ ? ND_NE : ND_EQ;
+  } else {
+    return false;
+  }
+  Node* then = node->rhs;
+  node->rhs = node->alt;
+  node->alt = then;
+  return true;
+}
+
+static void profile_apply(Node* node) {
+  ProfileSite* s = profile_lookup(node);
+  if (!s) return;
+  stats.profile_matched++;
+
+  switch (node->kind) {
+    case ND_IF:
+      if (node->alt && s->count >= PROFILE_HOT && s->hits * 2 < s->count &&
+          flip_condition(node)) {
+        node->pgo |= PGO_FLIPPED;
+      }
+      return;
+    case ND_WHILE:
+      if (s->count >= PROFILE_MIN_ENTRIES && s->hits < s->count) {
+        node->pgo |= PGO_COLD;
+      }
+      return;
+    default:
+      // 記録しながら推測すると、命令列にした演算が数えられなくなる
+      if (!profile_out && s->count >= PROFILE_HOT && s->hits == s->count) {
+        node->pgo |= PGO_NUMERIC;
+      }
+      return;
+  }
+}
+
+// パースした直後に呼ぶ。記録するサイトの形は、読み込んだ印で書き換える前に取る
+static void profile_program(Node* program) {
+  if (profile_out) profile_walk(program, profile_register, 0);
+  if (profile_in) profile_walk(program, profile_apply, 0);
+}
+
+static void profile_start() {
+  if (profile_in) profile_load(profile_in);
+  if (profile_out) atexit(profile_write);
+}
+
+static Value eval_node(Node* node);
+
+static Value eval(Node* node) {
+  if (!sample_hz) return eval_node(node);
+
+  int depth = prof_depth;
+  if (depth < PROF_STACK_MAX) prof_stack[depth] = node;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  prof_depth = depth + 1;
+  Value v = eval_node(node);
+  prof_depth = depth;
+  return v;
+}
+
+static Value eval_node(Node* node) {
+  budget_left--;
+  switch (node->kind) {
+    case ND_LAZY:
+      parse_lazy(node);
+      return eval_node(node);
+
+    case ND_PROGRAM: {
+      Node* statement = node->lhs;
+      while (statement) {
+        eval(statement);
+        statement = statement->next;
+      }
+      return value_nil();
+    }
+
+    case ND_IF: {
+      Value val = eval(node->lhs);
+      if (profile_out) {
+        // 反転したifも、元の条件が真だった回数として数える
+        profile_count(node, is_truthy(val) != ((node->pgo & PGO_FLIPPED) != 0));
+      }
+      if (is_truthy(val)) {
+        eval(node->rhs);
+      } else if (node->alt) {
+        eval(node->alt);
+      }
+      return value_nil();
+    }
+
+    case ND_EXPR_STMT: {
+      eval(node->lhs);
+      return value_nil();
+    }
+
+    case ND_WHILE: {
+      loop_temps_reset(node);
+      ProfileSite* site = profile_out ? profile_site(node) : NULL;
+      if (site) site->count++;
+      while (is_truthy(eval(node->lhs))) {
+        if (site) site->hits++;
+        eval(node->rhs);
+        if (budget_left <= 0) task_yield();
+      }
+      return value_nil();
+    }
+
+    case ND_PRINT_STMT: {
+      print_value(eval(node->lhs));
+      return value_nil();
+    }
+
+    case ND_BLOCK: {
+      current_env = env_push(current_env);
+      for (Node* s = node->lhs; s != NULL; s = s->next) {
+        eval(s);
+      }
+      current_env = env_pop(current_env);
+      return value_nil();
+    }
+
+    case ND_DECLARATION: {
+      Value v = node->lhs ? eval(node->lhs) : value_nil();
+      env_define(current_env, node->sval, v);
+      return value_nil();
+    }
+
+    case ND_IDENTIFIER: {
+      return env_get(current_env, node->sval);
+    }
+
+    case ND_REDUCE: {
+      // 上限などの不変式は元のループのもの。ベクトル化した側で使う前に捨てる
+      loop_temps_reset(node->lhs);
+      if (!eval_reduction(&reductions[node->slot])) eval(node->lhs);
+      return value_nil();
+    }
+
+    case ND_FEXPR:
+      return eval_fexpr(&fexprs[node->slot]);
+
+    case ND_INCREMENT: {
+      Entry* e = env_lookup(current_env, node->sval);
+      if (e == NULL) {
+        fprintf(stderr, "未定義の変数: %s\n", node->sval);
+        fail(EX_DATAERR);
+      }
+      if (e->value.type != VAL_NUM) {
+        fprintf(stderr, node->bval ? "算術演算は数値同士にしか使えません。\n"
+                                   : "+は数値同士か、文字列同士以外に使えません。\n");
+        fail(74);
+      }
+      e->value.num += node->val;
+      return e->value;
+    }
+
+    case ND_NUM:
+      return value_num(node->val);
+
+    case ND_STR:
+      return value_str(node->sval);
+
+    case ND_BOOL:
+      return value_bool(node->bval);
+
+    case ND_NIL:
+      return value_nil();
+
+    default:
+      return eval_expr(node);
+  }
+}
+
+// --- 一度きりのコンパイル（--single-pass） ---
+// 構文木を作らず、トークンを読みながら直接バイトコードを出す。命令は32ビットで、
+// 下位8ビットが命令、上位24ビットが引数（定数の添字・飛び先・個数）。
+// if/while/forの飛び先は、本体を出し終えてから書き戻す。
+// 木を作らないので、ループの最適化と--lazyは効かない。">" と ">=" は木と同じく
+// 左辺から順に評価し、OP_BINARY_SWAPで左右を入れ替えて比べる。
+
+typedef enum {
+  OP_CONST,          // consts[arg]を積む
+  OP_NIL,            // nilを積む
+  OP_TRUE,           // trueを積む
+  OP_FALSE,          // falseを積む
+  OP_POP,            // 捨てる
+  OP_GET,            // 変数consts[arg]の値を積む
+  OP_SET,            // 変数consts[arg]に代入する（値は残す）
+  OP_DEFINE,         // 変数consts[arg]を定義する
+  OP_BINARY,         // argはNodeKind
+  OP_BINARY_SWAP,    // 左右を入れ替えてからOP_BINARY（> と >=）
+  OP_NEG,            // -
+  OP_NOT,            // !
+  OP_INDEX,          // a[i]
+  OP_SET_INDEX,      // a[i] = v（値は残す）
+  OP_CALL,           // argは引数の数
+  OP_ARRAY,          // argは要素の数
+  OP_PRINT,          // print
+  OP_JUMP,           // argへ飛ぶ
+  OP_JUMP_IF_FALSE,  // 条件を取り出し、偽ならargへ飛ぶ
+  OP_AND,            // 偽なら値を残してargへ飛び、そうでなければ取り除く
+  OP_OR,             // 真なら値を残してargへ飛び、そうでなければ取り除く
+  OP_PUSH_SCOPE,     // ブロックに入る
+  OP_POP_SCOPE,      // ブロックを出る
+  OP_HALT,           // 終わり
+} OpCode;
+
+#define OP_ARG_MAX ((1u << 24) - 1)
+#define OP_NO_NAME OP_ARG_MAX  // SpFrame.arg: 代入先が変数でなくa[i]
+
+typedef struct {
+  uint32_t* code;
+  size_t len;
+  size_t cap;
+  Value* consts;
+  size_t consts_len;
+  size_t consts_cap;
+} Chunk;
+
+static bool single_pass = false;
+static Chunk chunk;
+
+static size_t emit(OpCode op, size_t arg) {
+  if (arg >= OP_ARG_MAX) {
+    fprintf(stderr, "スクリプトが大きすぎてコンパイルできません。\n");
+    exit(EX_DATAERR);
+  }
+  if (chunk.len == chunk.cap) {
+    chunk.cap = chunk.cap ? chunk.cap * 2 : 256;
+    chunk.code = realloc(chunk.code, chunk.cap * sizeof(uint32_t));
+    stats_alloc(ALLOC_CODE, chunk.cap * sizeof(uint32_t));
+    if (!chunk.code) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  chunk.code[chunk.len] = (uint32_t)op | (uint32_t)arg << 8;
+  return chunk.len++;
+}
+
+// 前に出した飛び命令の飛び先を、今の位置に書き換える
+static void patch(size_t at) {
+  if (chunk.len >= OP_ARG_MAX) {
+    fprintf(stderr, "スクリプトが大きすぎてコンパイルできません。\n");
+    exit(EX_DATAERR);
+  }
+  chunk.code[at] = (chunk.code[at] & 0xff) | (uint32_t)chunk.len << 8;
+}
+
+static size_t add_const(Value v) {
+  if (chunk.consts_len == chunk.consts_cap) {
+    chunk.consts_cap = chunk.consts_cap ? chunk.consts_cap * 2 : 64;
+    chunk.consts = realloc(chunk.consts, chunk.consts_cap * sizeof(Value));
+    stats_alloc(ALLOC_CODE, chunk.consts_cap * sizeof(Value));
+    if (!chunk.consts) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  chunk.consts[chunk.consts_len] = v;
+  return chunk.consts_len++;
+}
+
+static void sp_declaration();
+static void sp_statement();
+
+static void sp_expect_semicolon(int status) {
+  if (!match(TK_SEMICOLON)) {
+    fprintf(stderr, "セミコロンが必要です。\n");
+    exit(status);
+  }
+}
+
+// 式の最後の項が何だったか。代入のときに、出したばかりの読み出しを取り消して使う
+typedef enum {
+  SP_OTHER,
+  SP_VAR,    // 最後の命令がOP_GET
+  SP_INDEX,  // 最後の命令がOP_INDEX
+} SpOperand;
+
+typedef struct {
+  PrefixKind prefix;  // PRE_UNARY / PRE_GROUP / PRE_ARRAY のとき前置
+  ParseRule* rule;    // 中置のときの規則
+  size_t arg;  // 単項演算子のトークン・代入先の変数名・短絡の飛び元・引数の数
+  Precedence prec;  // 積む前の優先順位
+} SpFrame;
+
+static SpFrame* sp_stack;
+static size_t sp_stack_len;
+static size_t sp_stack_cap;
+
+static void sp_push(SpFrame f) {
+  if (sp_stack_len == sp_stack_cap) {
+    sp_stack_cap = sp_stack_cap ? sp_stack_cap * 2 : 64;
+    sp_stack = realloc(sp_stack, sp_stack_cap * sizeof(SpFrame));
+    if (!sp_stack) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  sp_stack[sp_stack_len++] = f;
+}
+
+static SpOperand sp_atom() {
+  Token* t = token;
+  token = token->next;
+  switch (t->type) {
+    case TK_NUMBER:
+      emit(OP_CONST, add_const(value_num(strtod(t->lexeme, NULL))));
+      return SP_OTHER;
+    case TK_STRING:
+      emit(OP_CONST, add_const(value_str(t->lexeme)));
+      return SP_OTHER;
+    case TK_IDENTIFIER:
+      emit(OP_GET, add_const(value_str(t->lexeme)));
+      return SP_VAR;
+    case TK_TRUE:
+      emit(OP_TRUE, 0);
+      return SP_OTHER;
+    case TK_FALSE:
+      emit(OP_FALSE, 0);
+      return SP_OTHER;
+    default:
+      emit(OP_NIL, 0);
+      return SP_OTHER;
+  }
+}
+
+// parse_precedenceと同じ手順で、ノードを作る代わりに命令を出す
+static void sp_expression() {
+  size_t base = sp_stack_len;
+  Precedence prec = PREC_ASSIGNMENT;
+  SpOperand last;
+
+  for (;;) {
+    ParseRule* rule = get_rule(token->type);
+    if (rule->prefix == PRE_UNARY || rule->prefix == PRE_GROUP) {
+      sp_push((SpFrame){.prefix = rule->prefix, .arg = token->type, .prec = prec});
+      prec = rule->prefix == PRE_UNARY ? PREC_UNARY : PREC_ASSIGNMENT;
+      token = token->next;
+      continue;
+    }
+    if (rule->prefix == PRE_ARRAY) {
+      token = token->next;
+      if (!match(TK_RIGHT_BRACKET)) {
+        sp_push((SpFrame){.prefix = PRE_ARRAY, .prec = prec});
+        prec = PREC_ASSIGNMENT;
+        continue;
+      }
+      emit(OP_ARRAY, 0);
+      last = SP_OTHER;
+    } else if (rule->prefix == PRE_ATOM) {
+      last = sp_atom();
+    } else {
+      fprintf(stderr, "式が必要です。\n");
+      exit(EX_DATAERR);
+    }
+
+    for (;;) {
+      ParseRule* infix = get_rule(token->type);
+      if (infix->infix != IN_NONE && infix->prec >= prec) {
+        token = token->next;
+        SpFrame f = {.rule = infix, .prec = prec};
+        if (infix->infix == IN_CALL && match(TK_RIGHT_PAREN)) {
+          emit(OP_CALL, 0);
+          last = SP_OTHER;
+          continue;
+        }
+        if (infix->infix == IN_ASSIGN) {
+          if (last == SP_OTHER) {
+            fprintf(stderr, "無効な代入先です\n");
+            exit(EX_DATAERR);
+          }
+          chunk.len--;
+          f.arg = last == SP_VAR ? chunk.code[chunk.len] >> 8 : OP_NO_NAME;
+        } else if (infix->kind == ND_AND || infix->kind == ND_OR) {
+          f.arg = emit(infix->kind == ND_AND ? OP_AND : OP_OR, 0);
+        }
+        sp_push(f);
+        prec = infix->infix == IN_BINARY ? infix->prec + 1 : PREC_ASSIGNMENT;
+        break;
+      }
+
+      if (sp_stack_len == base) return;
+
+      // 引数・要素の並び：","なら次の式へ、閉じ括弧なら個数を引数にして命令を出す
+      SpFrame* top = &sp_stack[sp_stack_len - 1];
+      if (top->prefix == PRE_ARRAY || (top->rule && top->rule->infix == IN_CALL)) {
+        top->arg++;
+        if (match(TK_COMMA)) {
+          prec = PREC_ASSIGNMENT;
+          break;
+        }
+
+        SpFrame f = sp_stack[--sp_stack_len];
+        prec = f.prec;
+        if (f.prefix == PRE_ARRAY) {
+          if (!match(TK_RIGHT_BRACKET)) {
+            fprintf(stderr, "配列が]で閉じていません。\n");
+            exit(EX_DATAERR);
+          }
+          emit(OP_ARRAY, f.arg);
+        } else {
+          if (!match(TK_RIGHT_PAREN)) {
+            fprintf(stderr, "引数が)で閉じていません。\n");
+            exit(EX_DATAERR);
+          }
+          emit(OP_CALL, f.arg);
+        }
+        last = SP_OTHER;
+        continue;
+      }
+
+      SpFrame f = sp_stack[--sp_stack_len];
+      prec = f.prec;
+
+      if (f.prefix == PRE_GROUP) {
+        if (!match(TK_RIGHT_PAREN)) {
+          fprintf(stderr, "式が括弧で閉じていません。\n");
+          exit(EX_DATAERR);
+        }
+      } else if (f.prefix == PRE_UNARY) {
+        emit(f.arg == TK_MINUS ? OP_NEG : OP_NOT, 0);
+        last = SP_OTHER;
+      } else if (f.rule->infix == IN_INDEX) {
+        if (!match(TK_RIGHT_BRACKET)) {
+          fprintf(stderr, "添字が]で閉じていません。\n");
+          exit(EX_DATAERR);
+        }
+        emit(OP_INDEX, 0);
+        last = SP_INDEX;
+      } else if (f.rule->infix == IN_ASSIGN) {
+        if (f.arg == OP_NO_NAME) {
+          emit(OP_SET_INDEX, 0);
+        } else {
+          emit(OP_SET, f.arg);
+        }
+        last = SP_OTHER;
+      } else if (f.rule->kind == ND_AND || f.rule->kind == ND_OR) {
+        patch(f.arg);
+        last = SP_OTHER;
+      } else {
+        emit(f.rule->swap ? OP_BINARY_SWAP : OP_BINARY, f.rule->kind);
+        last = SP_OTHER;
+      }
+    }
+  }
+}
+
+static void sp_varDecl() {
+  if (!expect(TK_IDENTIFIER)) {
+    fprintf(stderr, "変数名が必要です。\n");
+    exit(74);
+  }
+  size_t name = add_const(value_str(token->lexeme));
+  token = token->next;
+  if (match(TK_EQUAL)) {
+    sp_expression();
+  } else {
+    emit(OP_NIL, 0);
+  }
+  sp_expect_semicolon(74);
+  emit(OP_DEFINE, name);
+}
+
+static void sp_declaration() {
+  if (match(TK_VAR)) {
+    sp_varDecl();
+  } else {
+    sp_statement();
+  }
+}
+
+static void sp_ifStmt() {
+  if (!match(TK_LEFT_PAREN)) {
+    fprintf(stderr, "ifの後は()です。\n");
+    exit(EX_DATAERR);
+  }
+  sp_expression();
+  if (!match(TK_RIGHT_PAREN)) {
+    fprintf(stderr, "if文の{}画閉じてません。\n");
+    exit(EX_DATAERR);
+  }
+  size_t to_else = emit(OP_JUMP_IF_FALSE, 0);
+  sp_statement();
+
+  if (match(TK_ELSE)) {
+    size_t to_end = emit(OP_JUMP, 0);
+    patch(to_else);
+    sp_statement();
+    patch(to_end);
+  } else {
+    patch(to_else);
+  }
+}
+
+static void sp_whileStmt() {
+  if (!match(TK_LEFT_PAREN)) {
+    fprintf(stderr, "whileの後は()が必要\n");
+    exit(EX_DATAERR);
+  }
+  size_t top = chunk.len;
+  sp_expression();
+  if (!match(TK_RIGHT_PAREN)) {
+    fprintf(stderr, "while(condition)の後は{}が必要\n");
+    exit(EX_DATAERR);
+  }
+  size_t to_end = emit(OP_JUMP_IF_FALSE, 0);
+  sp_statement();
+  emit(OP_JUMP, top);
+  patch(to_end);
+}
+
+// 増分の式は本体より先に読むので、本体の後ろから飛び込む形にする:
+//   init; top: cond; JUMP_IF_FALSE end; JUMP body; inc: incr; POP; JUMP top;
+//   body: ...; JUMP inc; end:
+static void sp_forStmt() {
+  if (!match(TK_LEFT_PAREN)) {
+    fprintf(stderr, "()が必要です。\n");
+    exit(74);
+  }
+
+  // 初期化文
+  bool scoped = false;
+  if (match(TK_SEMICOLON)) {
+  } else if (match(TK_VAR)) {
+    emit(OP_PUSH_SCOPE, 0);
+    scoped = true;
+    sp_varDecl();
+  } else {
+    emit(OP_PUSH_SCOPE, 0);
+    scoped = true;
+    sp_expression();
+    sp_expect_semicolon(74);
+    emit(OP_POP, 0);
+  }
+
+  // 条件
+  size_t top = chunk.len;
+  size_t to_end = 0;
+  bool has_condition = !match(TK_SEMICOLON);
+  if (has_condition) {
+    sp_expression();
+    sp_expect_semicolon(EX_DATAERR);
+    to_end = emit(OP_JUMP_IF_FALSE, 0);
+  }
+
+  // 増分
+  size_t loop = top;
+  if (!expect(TK_RIGHT_PAREN)) {
+    size_t to_body = emit(OP_JUMP, 0);
+    loop = chunk.len;
+    sp_expression();
+    emit(OP_POP, 0);
+    emit(OP_JUMP, top);
+    patch(to_body);
+  }
+  if (!(match(TK_RIGHT_PAREN))) {
+    fprintf(stderr, ")が必要です。\n");
+    exit(EX_DATAERR);
+  }
+
+  // ループする文
+  sp_statement();
+  emit(OP_JUMP, loop);
+
+  if (has_condition) patch(to_end);
+  if (scoped) emit(OP_POP_SCOPE, 0);
+}
+
+static void sp_blockStmt() {
+  emit(OP_PUSH_SCOPE, 0);
+  while (!expect(TK_RIGHT_BRACE) && token->type != TK_EOF) {
+    sp_declaration();
+  }
+  if (!match(TK_RIGHT_BRACE)) {
+    fprintf(stderr, "ブロックが、}で閉じてません\n");
+    exit(EX_DATAERR);
+  }
+  emit(OP_POP_SCOPE, 0);
+}
+
+static void sp_statement() {
+  if (match(TK_IF)) {
+    sp_ifStmt();
+  } else if (match(TK_PRINT)) {
+    sp_expression();
+    sp_expect_semicolon(74);
+    emit(OP_PRINT, 0);
+  } else if (match(TK_WHILE)) {
+    sp_whileStmt();
+  } else if (match(TK_FOR)) {
+    sp_forStmt();
+  } else if (match(TK_LEFT_BRACE)) {
+    sp_blockStmt();
+  } else {
+    sp_expression();
+    sp_expect_semicolon(74);
+    emit(OP_POP, 0);
+  }
+}
+
+static void sp_program() {
+  chunk.len = 0;
+  chunk.consts_len = 0;
+  while (token->type != TK_EOF) {
+    sp_declaration();
+  }
+  emit(OP_HALT, 0);
+}
+
+static void vm_run(Chunk* c) {
+  static Value* stack;
+  static size_t cap;
+  size_t sp = 0;
+  uint32_t* code = c->code;
+  Value* consts = c->consts;
+  size_t pc = 0;
+
+  for (;;) {
+    if (sp + 1 >= cap) {
+      cap = cap ? cap * 2 : 256;
+      stack = realloc(stack, cap * sizeof(Value));
+      if (!stack) {
+        fprintf(stderr, "メモリ確保に失敗しました。\n");
+        exit(74);
+      }
+    }
+
+    uint32_t insn = code[pc++];
+    uint32_t arg = insn >> 8;
+    switch ((OpCode)(insn & 0xff)) {
+      case OP_CONST:
+        stack[sp++] = consts[arg];
+        break;
+      case OP_NIL:
+        stack[sp++] = value_nil();
+        break;
+      case OP_TRUE:
+        stack[sp++] = value_bool(true);
+        break;
+      case OP_FALSE:
+        stack[sp++] = value_bool(false);
+        break;
+      case OP_POP:
+        sp--;
+        break;
+      case OP_GET:
+        stack[sp++] = env_get(current_env, consts[arg].str);
+        break;
+      case OP_SET:
+        assign_variable(consts[arg].str, stack[sp - 1]);
+        break;
+      case OP_DEFINE:
+        env_define(current_env, consts[arg].str, stack[--sp]);
+        break;
+      case OP_BINARY:
+        sp--;
+        stack[sp - 1] = binary_op((NodeKind)arg, stack[sp - 1], stack[sp]);
+        break;
+      case OP_BINARY_SWAP:
+        sp--;
+        stack[sp - 1] = binary_op((NodeKind)arg, stack[sp], stack[sp - 1]);
+        break;
+      case OP_NEG:
+        stack[sp - 1] = value_num(-stack[sp - 1].num);
+        break;
+      case OP_NOT:
+        stack[sp - 1] = value_bool(!is_truthy(stack[sp - 1]));
+        break;
+      case OP_INDEX:
+        stack[sp - 2] = value_num(array_get(stack[sp - 2], stack[sp - 1]));
+        sp--;
+        break;
+      case OP_SET_INDEX:
+        stack[sp - 3] = array_set(stack[sp - 3], stack[sp - 2], stack[sp - 1]);
+        sp -= 2;
+        break;
+      case OP_CALL: {
+        Value result = call_native(stack[sp - arg - 1], &stack[sp - arg], arg);
+        sp -= arg;
+        stack[sp - 1] = result;
+        break;
+      }
+      case OP_ARRAY: {
+        Value result = array_literal(&stack[sp - arg], arg);
+        sp -= arg;
+        stack[sp++] = result;
+        break;
+      }
+      case OP_PRINT:
+        print_value(stack[--sp]);
+        break;
+      case OP_JUMP:
+        pc = arg;
+        break;
+      case OP_JUMP_IF_FALSE:
+        if (!is_truthy(stack[--sp])) pc = arg;
+        break;
+      case OP_AND:
+        if (!is_truthy(stack[sp - 1])) {
+          pc = arg;
+        } else {
+          sp--;
+        }
+        break;
+      case OP_OR:
+        if (is_truthy(stack[sp - 1])) {
+          pc = arg;
+        } else {
+          sp--;
+        }
+        break;
+      case OP_PUSH_SCOPE:
+        current_env = env_push(current_env);
+        break;
+      case OP_POP_SCOPE:
+        current_env = env_pop(current_env);
+        break;
+      case OP_HALT:
+        return;
+    }
+  }
+}
+
+static Node* compile(char* source) {
+  // --- トークナイズ ---
+  phase_begin(PHASE_SCAN);
+  scanTokens(source);
+  phase_end(PHASE_SCAN);
+
+  // -- パース ---
+  phase_begin(PHASE_PARSE);
+  token = head.next;
+  Node* node = program();
+  profile_program(node);
+  phase_end(PHASE_PARSE);
+
+  // --- 最適化 ---
+  // --lazyでは未パースの本体に代入が隠れているので、型推論はしない
+  if (optimize) {
+    phase_begin(PHASE_OPT);
+    optimize_loops(node, 0);
+    if (!lazy_parse) infer_types(node);
+    phase_end(PHASE_OPT);
+  }
+
+// --- 構文木の表示 ---
+#ifdef DEBUG
+  print_ast(node);
+#endif
+
+  return node;
+}
+
+static void run(char* source) {
+  if (single_pass) {
+    phase_begin(PHASE_SCAN);
+    scanTokens(source);
+    phase_end(PHASE_SCAN);
+
+    phase_begin(PHASE_PARSE);
+    token = head.next;
+    sp_program();
+    phase_end(PHASE_PARSE);
+
+    phase_begin(PHASE_EVAL);
+    vm_run(&chunk);
+    phase_end(PHASE_EVAL);
+    return;
+  }
+
+  Node* node = compile(source);
+
+  // --- 評価（ツリーウォーク）---
+  phase_begin(PHASE_EVAL);
+  eval(node);
+  phase_end(PHASE_EVAL);
+}
+
+static char* readFile(char* path) {
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "ファイルを開けませんでした: %s\n", path);
+    exit(EX_IOERR);
+  }
+
+  fseek(fp, 0L, SEEK_END);
+  size_t file_size = ftell(fp);
+  rewind(fp);
+
+  char* buf = (char*)calloc(file_size + 1, sizeof(char));
+  if (buf == NULL) {
+    fprintf(stderr, "バッファの確保に失敗しました: %s\n", path);
+    exit(EX_IOERR);
+  }
+
+  size_t n_read = fread(buf, sizeof(char), file_size, fp);
+  if (n_read < file_size) {
+    fprintf(stderr, "ファイルの読み取りに失敗しました: %s\n", path);
+    exit(EX_IOERR);
+  }
+
+  buf[n_read] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+static void runFile(char* path) { run(readFile(path)); }
+
+// --- Cへの変換（--emit-c） ---
+// パースした木をCの文に訳し、下のランタイムと一緒に1つのファイルに書く。
+// 評価の順を保つため、式は部分式ごとに一時変数に入れる3番地のコードにする。
+// スコープはCのブロックに、宣言はCの変数にする。型推論で数値と分かった変数と
+// 数値になる部分式はdouble、それ以外はValueで持つ。名前はここで解決し、
+// 宣言より前に読む変数は（組み込み関数でなければ）実行時のエラーにする。
+// 値の演算と組み込み関数は、インタプリタと同じasari-runtime.hを書き出して使う。
+
+// 生成するCの先頭。ランタイムが使うもののうち、stats_allocはここで消しておく
+static const char* emit_prelude =
+    "// asari-lox --emit-c で生成したファイル\n"
+    "#define _GNU_SOURCE\n"
+    "\n"
+    "// 使わない組み込み関数や、書くだけの変数もそのまま出す\n"
+    "#pragma GCC diagnostic ignored \"-Wunused-function\"\n"
+    "#pragma GCC diagnostic ignored \"-Wunused-variable\"\n"
+    "#pragma GCC diagnostic ignored \"-Wunused-but-set-variable\"\n"
+    "\n"
+    "#define stats_alloc(site, bytes) ((void)0)\n"
+    "\n";
+
+// asari-runtime.hをそのまま文字列にしたもの（Makefileで作る）
+static const char emit_runtime[] =
+#include "asari-runtime.inc"
+    ;
+
+// ランタイムの後に置く、生成したCだけで使う関数。組み込み関数の値n_<name>は
+// natives[]から書く
+static const char* emit_support =
+    "\n"
+    "static _Noreturn void fail(int status) { exit(status); }\n"
+    "\n"
+    "static Value native_readLine(Value* args, int argc) {\n"
+    "  (void)args;\n"
+    "  (void)argc;\n"
+    "  char* line = NULL;\n"
+    "  size_t cap = 0;\n"
+    "  ssize_t n = getline(&line, &cap, stdin);\n"
+    "  if (n < 0) return value_nil();\n"
+    "  if (n > 0 && line[n - 1] == '\\n') line[n - 1] = '\\0';\n"
+    "  return value_str(line);\n"
+    "}\n"
+    "\n"
+    "static Value rt_undefined(char* name) {\n"
+    "  fprintf(stderr, \"未定義の変数: %s\\n\", name);\n"
+    "  fail(65);\n"
+    "}\n"
+    "\n"
+    "static void rt_unassignable(char* name) {\n"
+    "  fprintf(stderr, \"未定義の変数%sに代入しようとしました。\\n\", name);\n"
+    "  fail(65);\n"
+    "}\n"
+    "\n";
+
+#define EMIT_PART_SIZE 256  // 分けた関数1つあたりの一時変数の数の目安
+
+typedef struct {
+  char* name;
+  int id;     // Cの変数v<id>_<name>
+  bool num;   // doubleで持つ
+  int depth;  // 宣言したブロックの深さ
+} EmitVar;
+
+static EmitVar* emit_vars;
+static size_t emit_vars_len;
+static size_t emit_vars_cap;
+static int emit_depth;
+static int emit_next_id;
+static bool emit_typed;     // 型推論の結果を使える
+static FILE* emit_out;      // 関数の本体を書く一時ファイル
+static FILE* emit_globals;  // トップレベルの変数を書く出力先
+
+// 式の結果。textは一時変数の名前か、そのまま書ける定数の式
+typedef struct {
+  char text[48];
+  bool num;   // doubleの式
+  bool temp;  // 一時変数
+} COperand;
+
+static void emit_line(const char* fmt, ...) {
+  for (int i = 0; i < emit_depth + 1; ++i) fputs("  ", emit_out);
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(emit_out, fmt, ap);
+  va_end(ap);
+  fputc('\n', emit_out);
+}
+
+static EmitVar* emit_lookup(char* name) {
+  for (size_t i = emit_vars_len; i > 0; --i) {
+    if (strcmp(emit_vars[i - 1].name, name) == 0) return &emit_vars[i - 1];
+  }
+  return NULL;
+}
+
+static bool is_native_name(char* name) {
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i) {
+    if (strcmp(natives[i].name, name) == 0) return true;
+  }
+  return false;
+}
+
+static _Noreturn void emit_too_deep() {
+  fprintf(stderr, "木が深すぎるためCに変換できません。\n");
+  exit(EX_SOFTWARE);
+}
+
+static COperand emit_temp(bool num) {
+  COperand o = {.num = num, .temp = true};
+  snprintf(o.text, sizeof(o.text), "t%d", emit_next_id++);
+  return o;
+}
+
+static COperand emit_const(bool num, const char* text) {
+  COperand o = {.num = num};
+  snprintf(o.text, sizeof(o.text), "%s", text);
+  return o;
+}
+
+// Valueとして使うときの式
+static char* as_value(COperand* o, char* buf) {
+  if (o->num) {
+    snprintf(buf, 64, "value_num(%s)", o->text);
+  } else {
+    snprintf(buf, 64, "%s", o->text);
+  }
+  return buf;
+}
+
+// doubleとして使うときの式（インタプリタと同じく型は確かめない）
+static char* as_num(COperand* o, char* buf) {
+  if (o->num) {
+    snprintf(buf, 64, "%s", o->text);
+  } else {
+    snprintf(buf, 64, "%s.num", o->text);
+  }
+  return buf;
+}
+
+static void emit_var_name(EmitVar* v, char* buf) {
+  snprintf(buf, 64, "v%d_%s", v->id, v->name);
+}
+
+static void emit_string(char* s) {
+  fputc('"', emit_out);
+  for (unsigned char* p = (unsigned char*)s; *p; ++p) {
+    if (*p == '"' || *p == '\\' || *p == '?') {
+      // ?はトライグラフにならないようにエスケープする
+      fprintf(emit_out, "\\%c", *p);
+    } else if (*p >= 0x20 && *p < 0x7f) {
+      fputc(*p, emit_out);
+    } else {
+      fprintf(emit_out, "\\%03o", *p);
+    }
+  }
+  fputc('"', emit_out);
+}
+
+static COperand emit_expr(Node* node, int depth);
+
+// 引数をValueの配列に入れ、その名前をbufに書く。引数がなければNULL
+static int emit_args(Node* list, char* buf, int depth) {
+  int argc = 0;
+  for (Node* a = list; a != NULL; a = a->rhs) argc++;
+  if (argc == 0) {
+    strcpy(buf, "NULL");
+    return 0;
+  }
+
+  COperand* ops = malloc(sizeof(COperand) * argc);
+  if (!ops) {
+    fprintf(stderr, "メモリ確保に失敗しました。\n");
+    exit(74);
+  }
+  int i = 0;
+  for (Node* a = list; a != NULL; a = a->rhs) ops[i++] = emit_expr(a->lhs, depth + 1);
+
+  snprintf(buf, 64, "a%d", emit_next_id++);
+  for (int d = 0; d < emit_depth + 1; ++d) fputs("  ", emit_out);
+  fprintf(emit_out, "Value %s[%d] = {", buf, argc);
+  for (i = 0; i < argc; ++i) {
+    char v[64];
+    fprintf(emit_out, "%s%s", i ? ", " : "", as_value(&ops[i], v));
+  }
+  fprintf(emit_out, "};\n");
+  free(ops);
+  return argc;
+}
+
+static COperand emit_expr(Node* node, int depth) {
+  char l[64], r[64], x[64];
+  if (depth > OPT_MAX_DEPTH) emit_too_deep();
+
+  switch (node->kind) {
+    case ND_NUM: {
+      if (isinf(node->val)) return emit_const(true, "HUGE_VAL");
+      char buf[48];
+      snprintf(buf, sizeof(buf), "%a", node->val);
+      return emit_const(true, buf);
+    }
+
+    case ND_STR: {
+      COperand t = emit_temp(false);
+      for (int i = 0; i < emit_depth + 1; ++i) fputs("  ", emit_out);
+      fprintf(emit_out, "Value %s = value_str(", t.text);
+      emit_string(node->sval);
+      fprintf(emit_out, ");\n");
+      return t;
+    }
+
+    case ND_BOOL:
+      return emit_const(false, node->bval ? "value_bool(true)" : "value_bool(false)");
+
+    case ND_NIL:
+      return emit_const(false, "value_nil()");
+
+    case ND_IDENTIFIER: {
+      // 後で兄弟の式が代入しても変わらないよう、読んだ値を写しておく
+      EmitVar* v = emit_lookup(node->sval);
+      COperand t = emit_temp(v && v->num);
+      if (v) {
+        emit_var_name(v, x);
+        emit_line("%s %s = %s;", v->num ? "double" : "Value", t.text, x);
+      } else if (is_native_name(node->sval)) {
+        emit_line("Value %s = n_%s;", t.text, node->sval);
+      } else {
+        emit_line("Value %s = rt_undefined(\"%s\");", t.text, node->sval);
+      }
+      return t;
+    }
+
+    case ND_ASSIGN: {
+      COperand val = emit_expr(node->rhs, depth + 1);
+      char* name = node->lhs->sval;
+      EmitVar* v = emit_lookup(name);
+      if (v) {
+        emit_var_name(v, x);
+        emit_line("%s = %s;", x, v->num ? as_num(&val, r) : as_value(&val, r));
+      } else if (is_native_name(name)) {
+        emit_line("n_%s = %s;", name, as_value(&val, r));
+      } else {
+        emit_line("rt_unassignable(\"%s\");", name);
+      }
+      return val;
+    }
+
+    case ND_ADD:
+    case ND_MINUS:
+    case ND_MUL:
+    case ND_DIV: {
+      COperand a = emit_expr(node->lhs, depth + 1);
+      COperand b = emit_expr(node->rhs, depth + 1);
+      char op = node->kind == ND_ADD     ? '+'
+                : node->kind == ND_MINUS ? '-'
+                : node->kind == ND_MUL   ? '*'
+                                         : '/';
+      if (a.num && b.num) {
+        COperand t = emit_temp(true);
+        emit_line("double %s = %s %c %s;", t.text, a.text, op, b.text);
+        return t;
+      }
+      if (node->kind == ND_ADD) {
+        COperand t = emit_temp(false);
+        emit_line("Value %s = add_values(%s, %s);", t.text, as_value(&a, l),
+                  as_value(&b, r));
+        return t;
+      }
+      emit_line("expect_numbers(%s, %s);", as_value(&a, l), as_value(&b, r));
+      COperand t = emit_temp(true);
+      emit_line("double %s = %s %c %s;", t.text, as_num(&a, l), op, as_num(&b, r));
+      return t;
+    }
+
+    case ND_LT:
+    case ND_LE: {
+      COperand a, b;
+      if (is_swapped(node)) {
+        b = emit_expr(node->rhs, depth + 1);
+        a = emit_expr(node->lhs, depth + 1);
+      } else {
+        a = emit_expr(node->lhs, depth + 1);
+        b = emit_expr(node->rhs, depth + 1);
+      }
+      COperand t = emit_temp(false);
+      emit_line("Value %s = value_bool(%s %s %s);", t.text, as_num(&a, l),
+                node->kind == ND_LT ? "<" : "<=", as_num(&b, r));
+      return t;
+    }
+
+    case ND_EQ:
+    case ND_NE: {
+      COperand a = emit_expr(node->lhs, depth + 1);
+      COperand b = emit_expr(node->rhs, depth + 1);
+      COperand t = emit_temp(false);
+      if (a.num && b.num) {
+        emit_line("Value %s = value_bool(%s %s %s);", t.text, a.text,
+                  node->kind == ND_EQ ? "==" : "!=", b.text);
+      } else {
+        emit_line("Value %s = value_bool(%sis_equal(%s, %s));", t.text,
+                  node->kind == ND_EQ ? "" : "!", as_value(&a, l), as_value(&b, r));
+      }
+      return t;
+    }
+
+    case ND_NEG: {
+      COperand a = emit_expr(node->lhs, depth + 1);
+      COperand t = emit_temp(true);
+      emit_line("double %s = -%s;", t.text, as_num(&a, l));
+      return t;
+    }
+
+    case ND_BANG: {
+      COperand a = emit_expr(node->lhs, depth + 1);
+      COperand t = emit_temp(false);
+      emit_line("Value %s = value_bool(!is_truthy(%s));", t.text, as_value(&a, l));
+      return t;
+    }
+
+    case ND_AND:
+    case ND_OR: {
+      // 短絡したら左辺の値がそのまま結果
+      COperand a = emit_expr(node->lhs, depth + 1);
+      COperand t = emit_temp(false);
+      emit_line("Value %s = %s;", t.text, as_value(&a, l));
+      emit_line("if (%sis_truthy(%s)) {", node->kind == ND_AND ? "" : "!", t.text);
+      emit_depth++;
+      COperand b = emit_expr(node->rhs, depth + 1);
+      emit_line("%s = %s;", t.text, as_value(&b, r));
+      emit_depth--;
+      emit_line("}");
+      return t;
+    }
+
+    case ND_INDEX: {
+      COperand a = emit_expr(node->lhs, depth + 1);
+      COperand i = emit_expr(node->rhs, depth + 1);
+      COperand t = emit_temp(true);
+      emit_line("double %s = array_get(%s, %s);", t.text, as_value(&a, l),
+                as_value(&i, r));
+      return t;
+    }
+
+    case ND_SET_INDEX: {
+      COperand a = emit_expr(node->lhs->lhs, depth + 1);
+      COperand i = emit_expr(node->lhs->rhs, depth + 1);
+      COperand v = emit_expr(node->rhs, depth + 1);
+      COperand t = emit_temp(false);
+      emit_line("Value %s = array_set(%s, %s, %s);", t.text, as_value(&a, l),
+                as_value(&i, r), as_value(&v, x));
+      return t;
+    }
+
+    case ND_CALL: {
+      COperand callee = emit_expr(node->lhs, depth + 1);
+      char args[64];
+      int argc = emit_args(node->rhs, args, depth + 1);
+      COperand t = emit_temp(false);
+      emit_line("Value %s = call_native(%s, %s, %d);", t.text, as_value(&callee, l),
+                args, argc);
+      return t;
+    }
+
+    case ND_ARRAY: {
+      char args[64];
+      int argc = emit_args(node->lhs, args, depth + 1);
+      COperand t = emit_temp(false);
+      emit_line("Value %s = array_literal(%s, %d);", t.text, args, argc);
+      return t;
+    }
+
+    default:
+      fprintf(stderr, "Cに変換できない式です。\n");
+      exit(EX_SOFTWARE);
+  }
+}
+
+static void emit_stmt(Node* node, int depth);
+
+// {}の中身を1段深く書く。{}ならその中の宣言はここで捨てる
+static void emit_body(Node* node, int depth) {
+  emit_depth++;
+  if (node->kind == ND_BLOCK) {
+    for (Node* s = node->lhs; s != NULL; s = s->next) emit_stmt(s, depth + 1);
+    while (emit_vars_len && emit_vars[emit_vars_len - 1].depth == emit_depth) {
+      emit_vars_len--;
+    }
+  } else {
+    emit_stmt(node, depth);
+  }
+  emit_depth--;
+}
+
+static void emit_declare(Node* node, int depth) {
+  COperand init = node->lhs ? emit_expr(node->lhs, depth + 1) : emit_const(false, "value_nil()");
+  char v[64], x[64];
+
+  // 同じスコープでの再宣言は同じ変数への代入
+  EmitVar* var = emit_lookup(node->sval);
+  if (var && var->depth == emit_depth) {
+    emit_var_name(var, v);
+    emit_line("%s = %s;", v, var->num ? as_num(&init, x) : as_value(&init, x));
+    return;
+  }
+
+  if (emit_vars_len == emit_vars_cap) {
+    emit_vars_cap = emit_vars_cap ? emit_vars_cap * 2 : 64;
+    emit_vars = realloc(emit_vars, emit_vars_cap * sizeof(EmitVar));
+    if (!emit_vars) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  bool num = emit_typed && node->slot >= 0 && bindings[node->slot].type == TY_NUM;
+  var = &emit_vars[emit_vars_len++];
+  *var = (EmitVar){node->sval, emit_next_id++, num, emit_depth};
+  emit_var_name(var, v);
+  if (emit_depth > 0) {
+    emit_line("%s %s = %s;", num ? "double" : "Value", v,
+              num ? as_num(&init, x) : as_value(&init, x));
+    return;
+  }
+  // トップレベルの変数は、分けた関数のどこからでも使えるようファイルに置く
+  fprintf(emit_globals, "static %s %s;\n", num ? "double" : "Value", v);
+  emit_line("%s = %s;", v, num ? as_num(&init, x) : as_value(&init, x));
+}
+
+static void emit_stmt(Node* node, int depth) {
+  char x[64];
+  if (depth > OPT_MAX_DEPTH) emit_too_deep();
+
+  switch (node->kind) {
+    case ND_PRINT_STMT: {
+      COperand v = emit_expr(node->lhs, depth + 1);
+      if (v.num) {
+        emit_line("printf(\"%%lf\\n\", %s);", v.text);
+      } else {
+        emit_line("print_value(%s);", v.text);
+      }
+      return;
+    }
+    case ND_EXPR_STMT: {
+      COperand v = emit_expr(node->lhs, depth + 1);
+      if (v.temp) emit_line("(void)%s;", v.text);
+      return;
+    }
+    case ND_DECLARATION:
+      emit_declare(node, depth);
+      return;
+    case ND_BLOCK:
+      emit_line("{");
+      emit_body(node, depth);
+      emit_line("}");
+      return;
+    case ND_IF: {
+      COperand c = emit_expr(node->lhs, depth + 1);
+      emit_line("if (is_truthy(%s)) {", as_value(&c, x));
+      emit_body(node->rhs, depth + 1);
+      if (node->alt) {
+        emit_line("} else {");
+        emit_body(node->alt, depth + 1);
+      }
+      emit_line("}");
+      return;
+    }
+    case ND_WHILE: {
+      // 本体の{}はCのループの{}と同じく、回るたびに新しいスコープになる
+      emit_line("for (;;) {");
+      emit_depth++;
+      COperand c = emit_expr(node->lhs, depth + 1);
+      emit_line("if (!is_truthy(%s)) break;", as_value(&c, x));
+      emit_depth--;
+      emit_body(node->rhs, depth + 1);
+      emit_line("}");
+      return;
+    }
+    default:
+      fprintf(stderr, "Cに変換できない文です。\n");
+      exit(EX_SOFTWARE);
+  }
+}
+
+static void emit_c(char* path, char* source) {
+  phase_begin(PHASE_SCAN);
+  scanTokens(source);
+  phase_end(PHASE_SCAN);
+
+  phase_begin(PHASE_PARSE);
+  token = head.next;
+  Node* program_node = program();
+  phase_end(PHASE_PARSE);
+
+  phase_begin(PHASE_OPT);
+  emit_typed = infer_bindings(program_node);
+  phase_end(PHASE_OPT);
+
+  emit_globals = fopen(path, "w");
+  emit_out = tmpfile();
+  if (!emit_globals || !emit_out) {
+    fprintf(stderr, "ファイルを開けませんでした: %s\n", path);
+    exit(EX_IOERR);
+  }
+  fputs(emit_prelude, emit_globals);
+  fputs(emit_runtime, emit_globals);
+  fputs(emit_support, emit_globals);
+  for (size_t i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i) {
+    fprintf(emit_globals, "static Value n_%s = {VAL_NATIVE, {.native = &natives[%zu]}};\n",
+            natives[i].name, i);
+  }
+  fputs("\n", emit_globals);
+
+  // 1つの関数が大きすぎるとCコンパイラが遅くなるので、トップレベルの文を
+  // 一時変数がEMIT_PART_SIZE個を超えるごとに別の関数に分ける
+  int parts = 0;
+  int part_start = 0;
+  for (Node* s = program_node->lhs; s != NULL; s = s->next) {
+    if (parts == 0 || emit_next_id - part_start > EMIT_PART_SIZE) {
+      if (parts > 0) fputs("}\n\n", emit_out);
+      fprintf(emit_out, "static void part%d(void) {\n", parts++);
+      part_start = emit_next_id;
+    }
+    emit_stmt(s, 0);
+  }
+  if (parts > 0) fputs("}\n\n", emit_out);
+
+  fputs("\n", emit_globals);
+  rewind(emit_out);
+  char buf[BUFSIZ];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), emit_out)) > 0) {
+    fwrite(buf, 1, n, emit_globals);
+  }
+  fclose(emit_out);
+
+  fputs("int main(void) {\n", emit_globals);
+  for (int i = 0; i < parts; ++i) fprintf(emit_globals, "  part%d();\n", i);
+  fputs("  return 0;\n}\n", emit_globals);
+  if (fclose(emit_globals) != 0) {
+    fprintf(stderr, "ファイルを書き出せませんでした: %s\n", path);
+    exit(EX_IOERR);
   }
 }
 
-Node* comparison() {
-  Node* node = term();
-  for (;;) {
-    if (match(TK_GREATER)) {
-      node = new_node(ND_LT, term(), node);
-    } else if (match(TK_GREATER_EQUAL)) {
-      node = new_node(ND_LE, term(), node);
-    } else if (match(TK_LESS)) {
-      node = new_node(ND_LT, node, term());
-    } else if (match(TK_LESS_EQUAL)) {
-      node = new_node(ND_LE, node, term());
+// --- 変更の監視（--watch） ---
+// スクリプトをinotifyで見張り、書き換わるたびに実行し直す。
+// 前回のソースと先頭・末尾の一致する長さを求め、変わった範囲にかかるトップレベルの
+// 宣言だけを字句解析・パースし直す。字句解析は、変わっていない末尾にある宣言の
+// 始まりに行き着いたところで打ち切り、そこから先はトークンも構文木も使い回す。
+// 宣言の位置はソースの終わりからの距離で持つので、末尾の宣言は数え直さなくてよい。
+// 編集で宣言の境目が崩れ、パースが使い回すはずのトークンにはみ出したときは全体を読み直す。
+// 実行は毎回forkした子で行うので、グローバル環境は毎回まっさらになる。パースの
+// エラーはexitするので、子でパースが通ったのを確かめてから親でも同じ更新をする。
+
+typedef struct {
+  Token* first;
+  Node* node;
+  size_t rofs;  // 始まりからソースの終わりまでの距離
+} WatchDecl;
+
+typedef struct {
+  char* source;
+  size_t len;
+  WatchDecl* decls;
+  size_t count;
+  Node* program;
+  size_t suffix;  // 前回と一致する末尾の長さ
+} WatchState;
+
+static WatchState watch = {.source = ""};
+
+#define WATCH_CMP_BLOCK 4096
+
+// 変わっていない末尾にある宣言のうち、始まりがrofsのもの
+static WatchDecl* watch_decl_at(size_t rofs) {
+  if (rofs > watch.suffix) return NULL;
+  size_t lo = 0, hi = watch.count;  // rofsは添字について狭義単調減少
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (watch.decls[mid].rofs > rofs) {
+      lo = mid + 1;
     } else {
-      return node;
+      hi = mid;
     }
   }
+  return lo < watch.count && watch.decls[lo].rofs == rofs ? &watch.decls[lo] : NULL;
 }
 
-Node* term() {
-  Node* node = factor();
+static bool watch_stop(size_t rofs) { return watch_decl_at(rofs) != NULL; }
 
-  for (;;) {
-    if (match(TK_PLUS)) {
-      node = new_node(ND_ADD, node, factor());
-    } else if (match(TK_MINUS)) {
-      node = new_node(ND_MINUS, node, factor());
+// sourceを新しい版として取り込み、パースし直した宣言の数を返す
+static size_t watch_update(char* source) {
+  size_t len = strlen(source);
+  size_t limit = len < watch.len ? len : watch.len;
+  size_t prefix = 0;
+  while (prefix + WATCH_CMP_BLOCK <= limit &&
+         memcmp(source + prefix, watch.source + prefix, WATCH_CMP_BLOCK) == 0) {
+    prefix += WATCH_CMP_BLOCK;
+  }
+  while (prefix < limit && source[prefix] == watch.source[prefix]) prefix++;
+  limit -= prefix;
+  watch.suffix = 0;
+  while (watch.suffix + WATCH_CMP_BLOCK <= limit &&
+         memcmp(source + len - watch.suffix - WATCH_CMP_BLOCK,
+                watch.source + watch.len - watch.suffix - WATCH_CMP_BLOCK,
+                WATCH_CMP_BLOCK) == 0) {
+    watch.suffix += WATCH_CMP_BLOCK;
+  }
+  while (watch.suffix < limit && source[len - 1 - watch.suffix] ==
+                                     watch.source[watch.len - 1 - watch.suffix]) {
+    watch.suffix++;
+  }
+
+  // 終わりが変わった位置にかかる最初の宣言から読み直す。宣言iの終わりは宣言i+1の始まり
+  size_t first = 0;
+  size_t hi = watch.count ? watch.count - 1 : 0;
+  while (first < hi) {
+    size_t mid = (first + hi) / 2;
+    if (watch.len - watch.decls[mid + 1].rofs < prefix) {
+      first = mid + 1;
     } else {
-      return node;
+      hi = mid;
     }
   }
-}
 
-Node* factor() {
-  Node* node = unary();
+  // 読み直しは宣言firstの始まりからで、そこは変わっていないので行も前回と同じ
+  Token* before = &head;
+  char* p = source;
+  unsigned long line = 0;
+  if (first > 0) {
+    before = watch.decls[first - 1].first;
+    while (before->next != watch.decls[first].first) before = before->next;
+    p = source + (watch.len - watch.decls[first].rofs);
+    line = watch.decls[first].first->line - 1;
+  }
+
+  Token* pos = before;
+  scan_gen++;
+  scan_end = source + len;
+  char* stopped = scan_from(p, line, &pos, watch_stop);
+  WatchDecl* sync = *stopped ? watch_decl_at((size_t)(scan_end - stopped)) : NULL;
+  if (sync) {
+    // 行を足し引きする編集なら、使い回す末尾のトークンの行をその分ずらす
+    int shift = (int)scan_line + 1 - sync->first->line;
+    if (shift != 0) {
+      for (Token* t = sync->first; t != NULL; t = t->next) t->line += shift;
+    }
+    pos->next = sync->first;
+  } else {
+    addToken(pos, TK_EOF, NULL, 0);
+  }
 
-  for (;;) {
-    if (match(TK_STAR)) {
-      node = new_node(ND_MUL, node, unary());
-    } else if (match(TK_SLASH)) {
-      node = new_node(ND_DIV, node, unary());
-    } else {
-      return node;
+  // 読み直したトークンを宣言ごとにパースする
+  WatchDecl* fresh = NULL;
+  size_t fresh_count = 0;
+  size_t fresh_cap = 0;
+  token = before->next;
+  while (!sync || token != sync->first) {
+    if (token->gen != scan_gen) {
+      // 使い回すはずの宣言にはみ出したので、全体を読み直す
+      free(fresh);
+      free(watch.decls);
+      watch = (WatchState){.source = ""};
+      return watch_update(source);
+    }
+    if (token->type == TK_EOF) break;
+
+    if (fresh_count == fresh_cap) {
+      fresh_cap = fresh_cap ? fresh_cap * 2 : 16;
+      fresh = realloc(fresh, fresh_cap * sizeof(WatchDecl));
+      if (!fresh) {
+        fprintf(stderr, "メモリ確保に失敗しました。\n");
+        exit(74);
+      }
     }
+    Token* start = token;
+    Node* node = declaration();
+    if (optimize) optimize_loops(node, 0);
+    fresh[fresh_count++] = (WatchDecl){start, node, start->rofs};
   }
-}
 
-Node* unary() {
-  if (match(TK_MINUS)) {
-    return new_node(ND_NEG, unary(), NULL);
+  // 宣言の表を 手前 + 読み直した分 + 末尾 に組み替え、つなぎ目だけnextを張り直す
+  size_t resume = sync ? (size_t)(sync - watch.decls) : watch.count;
+  size_t tail = watch.count - resume;
+  size_t count = first + fresh_count + tail;
+  if (count > watch.count) {
+    watch.decls = realloc(watch.decls, count * sizeof(WatchDecl));
+    if (!watch.decls) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+  }
+  memmove(watch.decls + first + fresh_count, watch.decls + resume,
+          tail * sizeof(WatchDecl));
+  memcpy(watch.decls + first, fresh, fresh_count * sizeof(WatchDecl));
+  free(fresh);
+  for (size_t i = 0; i < first; ++i) watch.decls[i].rofs += len - watch.len;
+
+  for (size_t i = first; i < first + fresh_count; ++i) {
+    watch.decls[i].node->next = i + 1 < count ? watch.decls[i + 1].node : NULL;
   }
-  if (match(TK_BANG)) {
-    return new_node(ND_BANG, unary(), NULL);
+  if (first > 0) {
+    watch.decls[first - 1].node->next = first < count ? watch.decls[first].node : NULL;
   }
-  return primary();
+  if (!watch.program) watch.program = new_node(ND_PROGRAM, NULL, NULL);
+  watch.program->lhs = count ? watch.decls[0].node : NULL;
+
+  watch.source = source;
+  watch.len = len;
+  watch.count = count;
+  return fresh_count;
 }
 
-Node* primary() {
-  if (expect(TK_NUMBER)) {
-    double val = strtod(token->lexeme, NULL);
-    token = token->next;
-    return new_node_num(val);
+static void watch_run(char* path, char* source) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    exit(EX_OSERR);
   }
-
-  if (expect(TK_STRING)) {
-    char* val = token->lexeme;
-    token = token->next;
-    return new_node_str(val);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EX_OSERR);
   }
 
-  if (expect(TK_TRUE)) {
-    token = token->next;
-    return new_node_bool(true);
+  if (pid == 0) {
+    forked_child = true;
+    close(fds[0]);
+    struct timespec from, to;
+    clock_gettime(CLOCK_MONOTONIC, &from);
+    size_t parsed = watch_update(source);
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    fprintf(stderr, "--- %s: %zu個中%zu個の宣言をパースしました（%.2fms） ---\n",
+            path, watch.count, parsed, elapsed(from, to) * 1e3);
+    if (write(fds[1], "", 1) != 1) exit(EX_OSERR);
+    close(fds[1]);
+
+    phase_begin(PHASE_EVAL);
+    eval(watch.program);
+    phase_end(PHASE_EVAL);
+    exit(0);
   }
 
-  if (expect(TK_FALSE)) {
-    token = token->next;
-    return new_node_bool(false);
+  // 子がパースを終えたら、同じ更新を親でもして次の版との比較に備える
+  close(fds[1]);
+  char c;
+  bool parsed = read(fds[0], &c, 1) == 1;
+  close(fds[0]);
+  if (parsed) {
+    watch_update(source);
+  } else {
+    free(source);
   }
+  waitpid(pid, NULL, 0);
+}
 
-  if (expect(TK_NIL)) {
-    token = token->next;
-    return new_node_nil();
+static int runWatch(char* path) {
+  // エディタは書き換えの代わりにrenameで置き換えることがあるので、ディレクトリを見張る
+  char* slash = strrchr(path, '/');
+  char* dir = slash ? strndup(path, slash - path + 1) : ".";
+  char* base = slash ? slash + 1 : path;
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    perror("inotify");
+    return EX_OSERR;
   }
 
-  if (match(TK_LEFT_PAREN)) {
-    Node* node = expression();
-    if (match(TK_RIGHT_PAREN)) {
-      return node;
+  watch_run(path, readFile(path));
+  for (;;) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      perror("inotify");
+      return EX_IOERR;
     }
 
-    fprintf(stderr, "式が括弧で閉じていません。\n");
-    exit(EX_DATAERR);
+    bool changed = false;
+    for (char* q = buf; q < buf + n;) {
+      struct inotify_event* ev = (struct inotify_event*)q;
+      if (ev->len && strcmp(ev->name, base) == 0) changed = true;
+      q += sizeof(struct inotify_event) + ev->len;
+    }
+    if (changed) watch_run(path, readFile(path));
   }
+}
 
-  if (expect(TK_IDENTIFIER)) {
-    char* name = token->lexeme;
-    token = token->next;
+// --- スナップショット（--snapshot-out / --snapshot-in） ---
+// グローバル環境をファイルに書き出し、次回の起動でmmapして使う。
+// 画像はヘッダ・Entryの表・文字列の順に並び、表はハッシュ表の配置そのままで、
+// キーと文字列の値は画像の先頭からのオフセットで持つ。読み込み時はオフセットを
+// ポインタに直すだけで、表はそのままグローバル環境として使う。
+
+#define SNAPSHOT_MAGIC "ASLXSNP1"
+
+typedef struct {
+  char magic[8];
+  uint32_t entry_size;  // sizeof(Entry)。別のビルドの画像を読まないため
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t entries;  // Entryの表のオフセット
+  uint64_t size;     // 画像全体の大きさ
+} SnapshotHeader;
+
+static void snapshot_write(char* path) {
+  // 書き出す変数を集める
+  size_t n = global.capacity <= ENV_SMALL_MAX ? global.count : global.capacity;
+  size_t capacity = ENV_SMALL_MAX * 4;
+  while ((global.count + 1) * 4 > capacity * 3) capacity *= 2;
+
+  size_t strings_size = 0;
+  size_t skipped = 0;
+  for (size_t i = 0; i < n; ++i) {
+    Entry* e = &global.entries[i];
+    if (e->key == NULL) continue;
+    strings_size += strlen(e->key) + 1;
+    switch (e->value.type) {
+      case VAL_STRING:
+        strings_size += strlen(e->value.str) + 1;
+        break;
+      case VAL_NIL:
+      case VAL_BOOL:
+      case VAL_NUM:
+        break;
+      case VAL_NATIVE:
+        // 組み込み関数は保存せず、読み込んだ側で登録し直す
+        strings_size -= strlen(e->key) + 1;
+        skipped++;
+        break;
+      default:
+        fprintf(stderr, "スナップショットに保存できない値です: %s\n", e->key);
+        exit(EX_DATAERR);
+    }
+  }
 
-    Node* node = (Node*)calloc(1, sizeof(Node));
-    node->kind = ND_IDENTIFIER;
-    node->sval = name;
-    return node;
+  size_t entries_offset = sizeof(SnapshotHeader);
+  size_t strings_offset = entries_offset + capacity * sizeof(Entry);
+  size_t size = strings_offset + strings_size;
+  char* image = (char*)calloc(size, 1);
+  if (!image) {
+    fprintf(stderr, "メモリ確保に失敗しました。\n");
+    exit(74);
   }
-}
 
-static Value value_num(double val) {
-  return (Value){.type = VAL_NUM, .num = val};
-}
+  SnapshotHeader* header = (SnapshotHeader*)image;
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->entry_size = sizeof(Entry);
+  header->count = global.count - skipped;
+  header->capacity = capacity;
+  header->entries = entries_offset;
+  header->size = size;
+
+  Entry* table = (Entry*)(image + entries_offset);
+  size_t pos = strings_offset;
+  for (size_t i = 0; i < n; ++i) {
+    Entry* e = &global.entries[i];
+    if (e->key == NULL || e->value.type == VAL_NATIVE) continue;
+
+    size_t j = e->hash & (capacity - 1);
+    while (table[j].key != NULL) j = (j + 1) & (capacity - 1);
+    table[j] = *e;
+
+    size_t len = strlen(e->key) + 1;
+    memcpy(image + pos, e->key, len);
+    table[j].key = (char*)(uintptr_t)pos;
+    pos += len;
+
+    if (e->value.type == VAL_STRING) {
+      len = strlen(e->value.str) + 1;
+      memcpy(image + pos, e->value.str, len);
+      table[j].value.str = (char*)(uintptr_t)pos;
+      pos += len;
+    }
+  }
 
-static Value value_str(char* str) {
-  return (Value){.type = VAL_STRING, .str = str};
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL || fwrite(image, 1, size, fp) != size || fclose(fp) != 0) {
+    fprintf(stderr, "スナップショットを書き出せませんでした: %s\n", path);
+    exit(EX_IOERR);
+  }
+  free(image);
 }
 
-static Value value_bool(bool val) {
-  return (Value){.type = VAL_BOOL, .boolean = val};
+static _Noreturn void snapshot_invalid(char* path) {
+  fprintf(stderr, "スナップショットの形式が違います: %s\n", path);
+  exit(EX_DATAERR);
 }
 
-static Value value_nil() { return (Value){.type = VAL_NIL}; }
+// 画像の中の、NULで終わる文字列を指すオフセットか
+static bool snapshot_string_ok(char* image, uint64_t size, uintptr_t offset) {
+  return offset < size && memchr(image + offset, '\0', size - offset) != NULL;
+}
 
-static bool is_equal(Value a, Value b) {
-  if (a.type == VAL_NIL && b.type == VAL_NIL) return true;
-  if (a.type == VAL_NIL || b.type == VAL_NIL) return false;
-  if (a.type != b.type) return false;
-  switch (a.type) {
-    case VAL_NUM:
-      return a.num == b.num;
-    case VAL_BOOL:
-      return a.boolean == b.boolean;
-    case VAL_STRING:
-      return strlen(a.str) == strlen(b.str) && strcmp(a.str, b.str) == 0;
-    default:
-      return false;
+static void snapshot_read(char* path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "スナップショットを開けませんでした: %s\n", path);
+    exit(EX_IOERR);
+  }
+  // オフセットをポインタに書き換えるので、書き込み可能なプライベートマッピングにする
+  char* image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "スナップショットをmmapできませんでした: %s\n", path);
+    exit(EX_IOERR);
   }
-}
 
-static bool is_truthy(Value a) {
-  // nilとfalse以外は、true
-  if (a.type == VAL_NIL) return false;
+  // 壊れた画像や別の形式のファイルで、マッピングの外を読み書きしないよう
+  // ヘッダの値と各オフセットを確かめてからポインタに直す
+  SnapshotHeader* header = (SnapshotHeader*)image;
+  uint64_t size = st.st_size;
+  if (size < sizeof(SnapshotHeader) ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->entry_size != sizeof(Entry) || header->size != size) {
+    snapshot_invalid(path);
+  }
+  uint64_t capacity = header->capacity;
+  if (header->entries < sizeof(SnapshotHeader) || header->entries > size ||
+      header->entries % _Alignof(Entry) != 0 ||
+      capacity > (size - header->entries) / sizeof(Entry) ||
+      capacity <= ENV_SMALL_MAX || (capacity & (capacity - 1)) != 0 ||
+      header->count >= capacity) {
+    snapshot_invalid(path);
+  }
 
-  if (a.type == VAL_BOOL) {
-    return a.boolean;
+  Entry* table = (Entry*)(image + header->entries);
+  uint64_t count = 0;
+  for (size_t i = 0; i < capacity; ++i) {
+    if (table[i].key == NULL) continue;
+    count++;
+    uintptr_t key = (uintptr_t)table[i].key;
+    if (!snapshot_string_ok(image, size, key)) snapshot_invalid(path);
+    table[i].key = image + key;
+    if (table[i].hash != hash_string(table[i].key)) snapshot_invalid(path);
+
+    switch (table[i].value.type) {
+      case VAL_STRING: {
+        uintptr_t str = (uintptr_t)table[i].value.str;
+        if (!snapshot_string_ok(image, size, str)) snapshot_invalid(path);
+        table[i].value.str = image + str;
+        break;
+      }
+      case VAL_NIL:
+      case VAL_BOOL:
+      case VAL_NUM:
+        break;
+      default:
+        // 配列や組み込み関数はポインタなので画像には入らない
+        snapshot_invalid(path);
+    }
   }
+  if (count != header->count) snapshot_invalid(path);
 
-  return true;
+  global.entries = table;
+  global.count = header->count;
+  global.capacity = header->capacity;
+  global.mapped = true;
 }
 
-static Value eval(Node* node) {
-  switch (node->kind) {
-    case ND_PROGRAM: {
-      Node* statement = node->lhs;
-      while (statement) {
-        eval(statement);
-        statement = statement->next;
-      }
-      return value_nil();
+// --- サーバーモード（--serve） ---
+// スクリプトのパースと--setupの実行を一度だけ行ってからN個のワーカーをforkする。
+// ワーカーはASTとsetup後のグローバル環境をコピーオンライトで共有し、Unixソケットで
+// 受け取ったリクエスト本文を変数requestに入れてスクリプトを評価し、標準出力を
+// そのまま接続先に返す。リクエストのトップレベルの変数は使い捨ての環境に置き、
+// setupで定義した変数への代入はリクエストごとに元に戻す。
+// ワーカーは処理数か最大RSSが上限に達するか、エラーで落ちたら作り直す。
+
+static int serve_workers = 4;
+static long serve_max_requests = 0;  // 0なら無制限
+static long serve_max_rss = 0;       // KB。0なら無制限
+
+static char* read_request(int fd) {
+  size_t len = 0, cap = 4096;
+  char* buf = malloc(cap);
+  for (;;) {
+    if (len + 1 == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
     }
-
-    case ND_IF: {
-      Value val = eval(node->lhs);
-      if (is_truthy(val)) {
-        eval(node->rhs);
-      } else if (node->alt) {
-        eval(node->alt);
-      }
-      return value_nil();
+    ssize_t n = read(fd, buf + len, cap - len - 1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
     }
+    if (n == 0) break;
+    len += n;
+  }
+  buf[len] = '\0';
+  return buf;
+}
 
-    case ND_EXPR_STMT: {
-      eval(node->lhs);
-      return value_nil();
-    }
+// 環境を丸ごと写すときに、値が指す行のブロックを数え直す
+static void entries_line_ref(Entry* entries, size_t n, int delta) {
+  for (size_t i = 0; i < n; ++i) {
+    if (entries[i].key) line_ref(entries[i].value, delta);
+  }
+}
 
-    case ND_WHILE: {
-      while (is_truthy(eval(node->lhs))) {
-        eval(node->rhs);
-      }
-      return value_nil();
+static _Noreturn void serve_worker(int listen_fd, Node* program) {
+  forked_child = true;
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+  // setup後のグローバル環境。リクエストのたびにこれに戻す
+  size_t n = global.capacity <= ENV_SMALL_MAX ? global.count : global.capacity;
+  Entry* pristine = malloc((n ? n : 1) * sizeof(Entry));
+  memcpy(pristine, global.entries, n * sizeof(Entry));
+  entries_line_ref(pristine, n, 1);
+
+  int saved_stdout = dup(STDOUT_FILENO);
+  for (long handled = 0;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      exit(EX_OSERR);
     }
 
-    case ND_PRINT_STMT: {
-      Value val = eval(node->lhs);
-      if (val.type == VAL_NUM) {
-        printf("%lf\n", val.num);
-      }
-      if (val.type == VAL_STRING) {
-        printf("%s\n", val.str);
-      }
-      if (val.type == VAL_BOOL) {
-        printf(val.boolean ? "true\n" : "false\n");
-      }
-      if (val.type == VAL_NIL) {
-        printf("nil\n");
-      }
-      return value_nil();
+    Env* env = env_push(&global);
+    env_define(env, "request", value_str(read_request(fd)));
+    current_env = env;
+
+    fflush(stdout);
+    dup2(fd, STDOUT_FILENO);
+    eval(program);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(fd);
+
+    current_env = env_pop(env);
+    entries_line_ref(global.entries, n, -1);
+    memcpy(global.entries, pristine, n * sizeof(Entry));
+    entries_line_ref(global.entries, n, 1);
+
+    ++handled;
+    if (serve_max_requests > 0 && handled >= serve_max_requests) exit(0);
+    if (serve_max_rss > 0) {
+      struct rusage ru;
+      getrusage(RUSAGE_SELF, &ru);
+      if (ru.ru_maxrss >= serve_max_rss) exit(0);
     }
+  }
+}
 
-    case ND_BLOCK: {
-      current_env = env_push(current_env);
-      for (Node* s = node->lhs; s != NULL; s = s->next) {
-        eval(s);
+static int runServe(char* sock_path, char* setup_path, char* script_path) {
+  keep_globals = true;
+  Node* program = compile(readFile(script_path));
+  if (setup_path) runFile(setup_path);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (listen_fd < 0 || strlen(sock_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ソケットを作れませんでした: %s\n", sock_path);
+    return EX_OSERR;
+  }
+  strcpy(addr.sun_path, sock_path);
+  unlink(sock_path);
+  if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 128) < 0) {
+    perror(sock_path);
+    return EX_OSERR;
+  }
+
+  fflush(stdout);
+  pid_t* workers = calloc(serve_workers, sizeof(pid_t));
+  for (;;) {
+    for (int i = 0; i < serve_workers; ++i) {
+      if (workers[i] != 0) continue;
+      pid_t pid = fork();
+      if (pid < 0) {
+        perror("fork");
+        return EX_OSERR;
       }
-      current_env = env_pop(current_env);
-      return value_nil();
+      if (pid == 0) serve_worker(listen_fd, program);
+      workers[i] = pid;
     }
 
-    case ND_DECLARATION: {
-      Value v = node->lhs ? eval(node->lhs) : value_nil();
-      env_define(current_env, node->sval, v);
-      return value_nil();
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      perror("wait");
+      return EX_OSERR;
     }
-
-    case ND_IDENTIFIER: {
-      return env_get(current_env, node->sval);
+    for (int i = 0; i < serve_workers; ++i) {
+      if (workers[i] == pid) workers[i] = 0;
     }
-
-    case ND_ASSIGN: {
-      char* name = node->lhs->sval;
-      Value v = eval(node->rhs);
-      if (!env_assign(current_env, name, v)) {
-        fprintf(stderr, "未定義の変数%sに代入しようとしました。\n", name);
-        exit(EX_DATAERR);
-      }
-      return v;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "ワーカー %d が異常終了したので作り直します。\n", (int)pid);
     }
+  }
+}
 
-    case ND_NUM:
-      return value_num(node->val);
-
-    case ND_STR:
-      return value_str(node->sval);
-
-    case ND_BOOL:
-      return value_bool(node->bval);
-
-    case ND_NIL:
-      return value_nil();
+// --- 入力を分割した並列実行（--shards） ---
+// 標準入力をN個の行単位の範囲に分け、範囲ごとにforkした子プロセスで同じスクリプトを
+// 実行する。スクリプトは親で一度だけパースし、子はASTをコピーオンライトで共有する。
+// グローバル環境はプロセスごとに別になる。子のreadLine()は自分の範囲だけをpreadで読み、
+// 標準出力は一時ファイルに書く。親は入力の順に子を待ち、出力をつなげて書き出す。
+// 標準入力が通常のファイルでなければ（パイプなど）、いったん一時ファイルに書き出す。
 
-    case ND_NEG: {
-      Value lval = eval(node->lhs);
-      return value_num(-lval.num);
-    }
+static int shard_count = 0;
 
-    case ND_BANG: {
-      Value val = eval(node->lhs);
-      return value_bool(!is_truthy(val));
-    }
+#define SHARD_COPY_SIZE (1 << 20)
 
-    case ND_ADD: {
-      Value lval = eval(node->lhs);
-      Value rval = eval(node->rhs);
-      if (lval.type == VAL_NUM && rval.type == VAL_NUM) {
-        return value_num(lval.num + rval.num);
-      } else if (lval.type == VAL_STRING && rval.type == VAL_STRING) {
-        size_t len1 = strlen(lval.str);
-        size_t len2 = strlen(rval.str);
-        char* buf = (char*)calloc(len1 + len2 + 1, sizeof(char));
-        if (!buf) {
-          fprintf(stderr, "メモリ確保に失敗しました。\n");
-          exit(74);
-        }
-        strcpy(buf, lval.str);
-        strcat(buf, rval.str);
-        return value_str(buf);
-      } else {
-        fprintf(stderr, "+は数値同士か、文字列同士以外に使えません。\n");
-        exit(74);
-      }
+static void copy_fd(int from, int to) {
+  char* buf = malloc(SHARD_COPY_SIZE);
+  for (;;) {
+    ssize_t n = read(from, buf, SHARD_COPY_SIZE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      perror("read");
+      exit(EX_IOERR);
     }
-
-    case ND_MINUS: {
-      Value lval = eval(node->lhs);
-      Value rval = eval(node->rhs);
-      if (lval.type == VAL_NUM && rval.type == VAL_NUM) {
-        return value_num(lval.num - rval.num);
+    if (n == 0) break;
+    for (ssize_t done = 0; done < n;) {
+      ssize_t w = write(to, buf + done, n - done);
+      if (w < 0 && errno == EINTR) continue;
+      if (w < 0) {
+        perror("write");
+        exit(EX_IOERR);
       }
+      done += w;
     }
+  }
+  free(buf);
+}
 
-    case ND_MUL: {
-      Value lval = eval(node->lhs);
-      Value rval = eval(node->rhs);
-      if (lval.type == VAL_NUM && rval.type == VAL_NUM) {
-        return value_num(lval.num * rval.num);
-      }
-    }
+static int shard_tmpfile() {
+  FILE* tmp = tmpfile();
+  if (!tmp) {
+    perror("tmpfile");
+    exit(EX_CANTCREAT);
+  }
+  return fileno(tmp);
+}
 
-    case ND_DIV: {
-      Value lval = eval(node->lhs);
-      Value rval = eval(node->rhs);
-      if (lval.type == VAL_NUM && rval.type == VAL_NUM) {
-        return value_num(lval.num / rval.num);
-      }
-    }
+// offより後で最初の行の先頭。offがちょうど行頭ならそのまま
+static off_t shard_align(int fd, off_t off, off_t size) {
+  if (off == 0) return 0;
+  char buf[65536];
+  for (off_t pos = off - 1; pos < size;) {
+    ssize_t n = pread(fd, buf, sizeof(buf), pos);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    char* nl = memchr(buf, '\n', n);
+    if (nl) return pos + (nl - buf) + 1;
+    pos += n;
+  }
+  return size;
+}
 
-    case ND_EQ: {
-      Value lval = eval(node->lhs);
-      Value rval = eval(node->rhs);
-      return value_bool(is_equal(lval, rval));
-    }
+static int runShards(char* script_path, int n) {
+  Node* program = compile(readFile(script_path));
 
-    case ND_NE: {
-      Value lval = eval(node->lhs);
-      Value rval = eval(node->rhs);
-      return value_bool(!is_equal(lval, rval));
-    }
+  int in_fd = STDIN_FILENO;
+  struct stat st;
+  if (fstat(in_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    in_fd = shard_tmpfile();
+    copy_fd(STDIN_FILENO, in_fd);
+    fstat(in_fd, &st);
+  }
+  off_t size = st.st_size;
+
+  off_t* bounds = calloc(n + 1, sizeof(off_t));
+  bounds[n] = size;
+  for (int k = 1; k < n; ++k) {
+    off_t off = (off_t)((double)size * k / n);
+    if (off < bounds[k - 1]) off = bounds[k - 1];
+    bounds[k] = shard_align(in_fd, off, size);
+  }
 
-    case ND_LT: {
-      Value lval = eval(node->lhs);
-      Value rval = eval(node->rhs);
-      return value_bool(lval.num < rval.num);
+  fflush(stdout);
+  pid_t* pids = calloc(n, sizeof(pid_t));
+  int* outs = calloc(n, sizeof(int));
+  for (int k = 0; k < n; ++k) {
+    outs[k] = shard_tmpfile();
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return EX_OSERR;
     }
-
-    case ND_LE: {
-      Value lval = eval(node->lhs);
-      Value rval = eval(node->rhs);
-      return value_bool(lval.num <= rval.num);
+    if (pid == 0) {
+      forked_child = true;
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      stdin_reader = (LineReader){.fd = in_fd, .ranged = true,
+                                  .offset = bounds[k], .limit = bounds[k + 1]};
+      dup2(outs[k], STDOUT_FILENO);
+      eval(program);
+      fflush(stdout);
+      exit(0);
     }
+    pids[k] = pid;
+  }
 
-    case ND_OR: {
-      Value lval = eval(node->lhs);
-      if (is_truthy(lval)) return lval;
-      return eval(node->rhs);
+  // 先に終わった分から順に書き出す。失敗した範囲があっても残りの出力は出す
+  int result = 0;
+  for (int k = 0; k < n; ++k) {
+    int status;
+    while (waitpid(pids[k], &status, 0) < 0) {
+      if (errno != EINTR) {
+        perror("waitpid");
+        return EX_OSERR;
+      }
     }
-
-    case ND_AND: {
-      Value lval = eval(node->lhs);
-      if (!is_truthy(lval)) return lval;
-      return eval(node->rhs);
+    lseek(outs[k], 0, SEEK_SET);
+    copy_fd(outs[k], STDOUT_FILENO);
+    close(outs[k]);
+
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+    if (code != 0) {
+      fprintf(stderr, "シャード %d（%lld〜%lldバイト目）が異常終了しました。\n", k,
+              (long long)bounds[k], (long long)bounds[k + 1]);
+      if (result == 0) result = code;
     }
-
-    default:
-      break;
   }
+  return result;
 }
 
-static void run(char* source) {
-  // --- トークナイズ ---
-  scanTokens(source);
+// --- グリーンスレッド（--green） ---
+// 複数のスクリプトを1つのOSスレッド上でコルーチンとして交互に実行する。
+// 各タスクは自分のスタックとグローバル環境を持ち、budget_leftを使い切ると
+// ND_WHILEの後方分岐でスケジューラに戻る。スケジューラは重み付きのラウンドロビンで、
+// 優先度pのタスクには slice_budget * p ノードを与える。CPU時間の上限を超えたタスクと、
+// 実行時エラーを起こしたタスクはそこで打ち切り、他のタスクは走らせ続ける。
 
-  // -- パース ---
-  token = head.next;
-  Node* node = program();
+typedef enum {
+  TASK_READY,
+  TASK_DONE,
+  TASK_FAILED,
+} TaskState;
+
+typedef struct {
+  char* path;
+  int priority;
+  Node* program;
+  Env* env;  // 中断中のcurrent_env
+  ucontext_t context;
+  char* stack;
+  TaskState state;
+  int status;
+  double cpu_used;  // 秒
+} Task;
+
+#define TASK_STACK_SIZE (1 << 20)
+
+static bool green_mode = false;
+static long slice_budget = 10000;
+static double cpu_limit = 0;  // 秒。0なら無制限
+static Task* running_task;
+static ucontext_t scheduler_context;
+
+static void task_yield() {
+  if (!running_task) {
+    budget_left = LONG_MAX;
+    return;
+  }
+  swapcontext(&running_task->context, &scheduler_context);
+}
 
-// --- 構文木の表示 ---
-#ifdef DEBUG
-  print_ast(node);
-#endif
+static _Noreturn void fail(int status) {
+  if (!running_task) exit(status);
 
-  // --- 評価（ツリーウォーク）---
-  eval(node);
+  running_task->state = TASK_FAILED;
+  running_task->status = status;
+  setcontext(&scheduler_context);
+  abort();
 }
 
-static void runFile(char* path) {
-  FILE* fp = fopen(path, "r");
-  if (fp == NULL) {
-    fprintf(stderr, "ファイルを開けませんでした: %s\n", path);
-    exit(EX_IOERR);
-  }
+static void task_main() {
+  eval(running_task->program);
+  running_task->state = TASK_DONE;
+}
 
-  fseek(fp, 0L, SEEK_END);
-  size_t file_size = ftell(fp);
-  rewind(fp);
+static double cpu_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-  char* buf = (char*)calloc(file_size + 1, sizeof(char));
-  if (buf == NULL) {
-    fprintf(stderr, "バッファの確保に失敗しました: %s\n", path);
-    exit(EX_IOERR);
+static int runGreen(int n, char** scripts) {
+  Task* tasks = (Task*)calloc(n, sizeof(Task));
+
+  for (int i = 0; i < n; ++i) {
+    Task* t = &tasks[i];
+    t->path = scripts[i];
+    t->priority = 1;
+    // path:priority
+    char* colon = strrchr(scripts[i], ':');
+    if (colon && colon[1] != '\0' && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+      *colon = '\0';
+      t->priority = atoi(colon + 1) > 0 ? atoi(colon + 1) : 1;
+    }
+    t->program = compile(readFile(t->path));
+    // タスクごとに組み込み関数を入れた環境を作る。あるスクリプトが組み込み関数の
+    // 名前に代入しても、他のタスクからは見えない
+    t->env = env_push(NULL);
+    define_natives(t->env);
+    t->stack = malloc(TASK_STACK_SIZE);
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = t->stack;
+    t->context.uc_stack.ss_size = TASK_STACK_SIZE;
+    t->context.uc_link = &scheduler_context;
+    makecontext(&t->context, task_main, 0);
   }
 
-  size_t n_read = fread(buf, sizeof(char), file_size, fp);
-  if (n_read < file_size) {
-    fprintf(stderr, "ファイルの読み取りに失敗しました: %s\n", path);
-    exit(EX_IOERR);
+  phase_begin(PHASE_EVAL);
+  int status = 0;
+  for (bool any = true; any;) {
+    any = false;
+    for (int i = 0; i < n; ++i) {
+      Task* t = &tasks[i];
+      if (t->state != TASK_READY) continue;
+      any = true;
+
+      running_task = t;
+      current_env = t->env;
+      budget_left = slice_budget * t->priority;
+      double start = cpu_now();
+      swapcontext(&scheduler_context, &t->context);
+      t->cpu_used += cpu_now() - start;
+      t->env = current_env;
+      running_task = NULL;
+      budget_left = LONG_MAX;
+
+      if (t->state == TASK_FAILED) {
+        fprintf(stderr, "%s: 実行時エラーで中断しました。\n", t->path);
+      } else if (t->state == TASK_READY && cpu_limit > 0 &&
+                 t->cpu_used > cpu_limit) {
+        fprintf(stderr, "%s: CPU時間の上限(%.0fms)を超えたので中断しました。\n",
+                t->path, cpu_limit * 1e3);
+        t->state = TASK_FAILED;
+        t->status = EX_SOFTWARE;
+      }
+      if (t->state == TASK_FAILED && status == 0) status = t->status;
+      if (t->state != TASK_READY) {
+        free(t->stack);
+        t->stack = NULL;
+      }
+    }
   }
+  phase_end(PHASE_EVAL);
 
-  buf[n_read] = '\0';
-  fclose(fp);
-
-  run(buf);
+  current_env = &global;
+  free(tasks);
+  return status;
 }
 
 static void runPrompt() {
-  char buf[4096] = "";
+  keep_globals = true;
   for (;;) {
     printf("> ");
-    fgets(buf, sizeof(buf), stdin);
-    run(buf);
+    fflush(stdout);
+    char* line = read_line(&stdin_reader);
+    if (line == NULL) {
+      printf("\n");
+      return;
+    }
+    // 木やハッシュコンスの表が指し続けるので、ブロックから写しておく
+    run(strdup(line));
   }
 }
 
+static void usage() {
+  printf("Usage: asari-lox [--stats[=json]] [--no-opt] [--fast-math] [--lazy] [--dump-types] [--dump-dead]\n");
+  printf("                 [--sample-profile[=hz]] [--sample-profile-out file] [--perf-counters]\n");
+  printf("                 [--write-profile file] [--use-profile file] [script]\n");
+  printf("       asari-lox --single-pass [script]\n");
+  printf("       asari-lox --check script\n");
+  printf("       asari-lox --emit-c out.c script\n");
+  printf("       asari-lox --watch [--lazy] [--no-opt] script\n");
+  printf("       asari-lox [--snapshot-in file] [--snapshot-out file] [script]\n");
+  printf("       asari-lox --serve sock [--workers=N] [--max-requests=N] [--max-rss=KB] [--setup file] script\n");
+  printf("       asari-lox --shards=N script < input\n");
+  printf("       asari-lox --green [--slice=N] [--cpu-limit=MS] script[:priority]...\n");
+  exit(EX_USAGE);
+}
+
 int main(int argc, char** argv) {
-  if (argc > 2) {
-    printf("Usage: asari-lox [script]\n");
-    exit(EX_USAGE);
+  bool check_only = false;
+  bool watch_mode = false;
+  char* snapshot_in = NULL;
+  char* snapshot_out = NULL;
+  char* serve_sock = NULL;
+  char* setup = NULL;
+  char* c_path = NULL;
+  int i = 1;
+  for (; i < argc && strncmp(argv[i], "--", 2) == 0; ++i) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      stats_mode = STATS_TEXT;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      stats_mode = STATS_JSON;
+    } else if (strcmp(argv[i], "--single-pass") == 0) {
+      single_pass = true;
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      watch_mode = true;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      lazy_parse = true;
+    } else if (strcmp(argv[i], "--check") == 0) {
+      check_only = true;
+    } else if (strcmp(argv[i], "--no-opt") == 0) {
+      optimize = false;
+    } else if (strcmp(argv[i], "--fast-math") == 0) {
+      fast_math = true;
+    } else if (strcmp(argv[i], "--sample-profile") == 0) {
+      sample_hz = 1000;
+    } else if (strncmp(argv[i], "--sample-profile=", 17) == 0) {
+      sample_hz = atoi(argv[i] + 17);
+      if (sample_hz <= 0) usage();
+    } else if (strcmp(argv[i], "--sample-profile-out") == 0 && i + 1 < argc) {
+      prof_out = argv[++i];
+    } else if (strcmp(argv[i], "--perf-counters") == 0) {
+      perf_open();
+    } else if (strcmp(argv[i], "--dump-types") == 0) {
+      dump_types = true;
+    } else if (strcmp(argv[i], "--dump-dead") == 0) {
+      dump_dead = true;
+    } else if (strcmp(argv[i], "--write-profile") == 0 && i + 1 < argc) {
+      profile_out = argv[++i];
+    } else if (strcmp(argv[i], "--use-profile") == 0 && i + 1 < argc) {
+      profile_in = argv[++i];
+    } else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+      c_path = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot-in") == 0 && i + 1 < argc) {
+      snapshot_in = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot-out") == 0 && i + 1 < argc) {
+      snapshot_out = argv[++i];
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serve_sock = argv[++i];
+    } else if (strcmp(argv[i], "--setup") == 0 && i + 1 < argc) {
+      setup = argv[++i];
+    } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+      serve_workers = atoi(argv[i] + 10);
+      if (serve_workers <= 0) usage();
+    } else if (strncmp(argv[i], "--max-requests=", 15) == 0) {
+      serve_max_requests = atol(argv[i] + 15);
+    } else if (strncmp(argv[i], "--max-rss=", 10) == 0) {
+      serve_max_rss = atol(argv[i] + 10);
+    } else if (strncmp(argv[i], "--shards=", 9) == 0) {
+      shard_count = atoi(argv[i] + 9);
+      if (shard_count <= 0) usage();
+    } else if (strcmp(argv[i], "--green") == 0) {
+      green_mode = true;
+    } else if (strncmp(argv[i], "--slice=", 8) == 0) {
+      slice_budget = atol(argv[i] + 8);
+      if (slice_budget <= 0) usage();
+    } else if (strncmp(argv[i], "--cpu-limit=", 12) == 0) {
+      cpu_limit = atof(argv[i] + 12) / 1e3;
+    } else {
+      usage();
+    }
+  }
+  // 子プロセスで評価するモードでは、親のプロセスだけを測っても評価の分が入らない。
+  // ITIMER_PROFもforkした子には引き継がれない
+  if (prof_out && !sample_hz) sample_hz = 1000;
+  if (shard_count > 0 || serve_sock || watch_mode) {
+    const char* flag = stats_mode != STATS_OFF ? "--stats"
+                       : perf_enabled          ? "--perf-counters"
+                       : sample_hz             ? "--sample-profile"
+                       : profile_out           ? "--write-profile"
+                                               : NULL;
+    if (flag) {
+      fprintf(stderr, "%sは、--shards・--serve・--watchと一緒に使えません。\n", flag);
+      exit(EX_USAGE);
+    }
+  }
+  if (stats_mode != STATS_OFF) atexit(stats_report);
+  if (perf_enabled) atexit(perf_report);
+  if (sample_hz) prof_start();
+  profile_start();
+  define_natives(&global);
+
+  if (green_mode) {
+    if (i == argc) usage();
+    return runGreen(argc - i, argv + i);
+  }
+  if (argc - i > 1) usage();
+
+  // --check: 本体も含めて全体をパースし、構文エラーがなければ実行せずに終わる
+  if (check_only) {
+    if (i == argc) usage();
+    lazy_parse = false;
+    compile(readFile(argv[i]));
+    return 0;
+  }
+
+  // --emit-c: 全体をパースしてCに変換し、実行はしない
+  if (c_path) {
+    if (i == argc) usage();
+    lazy_parse = false;
+    emit_c(c_path, readFile(argv[i]));
+    return 0;
+  }
+
+  if (watch_mode) {
+    if (i == argc) usage();
+    return runWatch(argv[i]);
+  }
+
+  if (snapshot_in) {
+    snapshot_read(snapshot_in);
+    define_natives(&global);
+  }
+  if (shard_count > 0) {
+    if (i == argc) usage();
+    return runShards(argv[i], shard_count);
+  }
+  if (serve_sock) {
+    if (i == argc) usage();
+    return runServe(serve_sock, setup, argv[i]);
+  }
+  if (snapshot_out) {
+    if (i == argc) usage();
+    keep_globals = true;
+    runFile(argv[i]);
+    snapshot_write(snapshot_out);
+    return 0;
   }
 
-  if (argc == 2) {
-    runFile(argv[1]);
+  if (i < argc) {
+    runFile(argv[i]);
   } else {
     runPrompt();
   }
@@ -0,0 +1,533 @@
+// asari-loxの値と、その演算・組み込み関数。
+// インタプリタはこのファイルを#includeし、--emit-cはビルド時にこのファイルを
+// 文字列にしたもの（asari-runtime.inc、Makefileで作る）を生成するCの先頭に書く。
+// 同じコードを使うので、変換したCとインタプリタで結果とエラーが揃う。
+//
+// 取り込む側で用意するもの:
+//   stats_alloc(site, bytes)  確保した量を数える（ALLOC_CONCAT, ALLOC_ARRAY）
+//   fail(status)              実行時エラーで止まる
+//   native_readLine           標準入力から1行読む
+
+#ifndef ASARI_RUNTIME_H
+#define ASARI_RUNTIME_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef struct Value Value;
+typedef struct Array Array;
+typedef struct Native Native;
+
+typedef enum {
+  VAL_NIL,     // nil
+  VAL_BOOL,    // 真偽値
+  VAL_NUM,     // 数値
+  VAL_STRING,  // 文字列
+  VAL_ARRAY,   // 数値の配列
+  VAL_NATIVE,  // Cで書いた組み込み関数
+} ValueType;
+
+struct Value {
+  ValueType type;
+  union {
+    double num;
+    bool boolean;
+    char* str;
+    Array* array;
+    Native* native;
+  };
+};
+
+// 引数は評価用の値スタックに積んだまま渡す。呼び出しごとに確保はしない
+typedef Value (*NativeFn)(Value* args, int argc);
+
+struct Native {
+  char* name;
+  int arity;
+  NativeFn fn;
+};
+
+// 要素を詰めて持つdoubleの配列。値としては参照で扱う
+struct Array {
+  double* data;
+  size_t len;
+  size_t cap;
+};
+
+static _Noreturn void fail(int status);
+static Value native_readLine(Value* args, int argc);
+
+static Value value_num(double val) {
+  return (Value){.type = VAL_NUM, .num = val};
+}
+
+static Value value_str(char* str) {
+  return (Value){.type = VAL_STRING, .str = str};
+}
+
+static Value value_bool(bool val) {
+  return (Value){.type = VAL_BOOL, .boolean = val};
+}
+
+static Value value_nil() { return (Value){.type = VAL_NIL}; }
+
+static Value value_array(Array* array) {
+  return (Value){.type = VAL_ARRAY, .array = array};
+}
+
+static bool is_equal(Value a, Value b) {
+  if (a.type == VAL_NIL && b.type == VAL_NIL) return true;
+  if (a.type == VAL_NIL || b.type == VAL_NIL) return false;
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case VAL_NUM:
+      return a.num == b.num;
+    case VAL_BOOL:
+      return a.boolean == b.boolean;
+    case VAL_STRING:
+      return strlen(a.str) == strlen(b.str) && strcmp(a.str, b.str) == 0;
+    case VAL_ARRAY:
+      return a.array == b.array;
+    case VAL_NATIVE:
+      return a.native == b.native;
+    default:
+      return false;
+  }
+}
+
+static bool is_truthy(Value a) {
+  // nilとfalse以外は、true
+  if (a.type == VAL_NIL) return false;
+
+  if (a.type == VAL_BOOL) {
+    return a.boolean;
+  }
+
+  return true;
+}
+
+static void print_value(Value val) {
+  if (val.type == VAL_NUM) {
+    printf("%lf\n", val.num);
+  }
+  if (val.type == VAL_STRING) {
+    printf("%s\n", val.str);
+  }
+  if (val.type == VAL_BOOL) {
+    printf(val.boolean ? "true\n" : "false\n");
+  }
+  if (val.type == VAL_NIL) {
+    printf("nil\n");
+  }
+  if (val.type == VAL_NATIVE) {
+    printf("<native fn %s>\n", val.native->name);
+  }
+  if (val.type == VAL_ARRAY) {
+    printf("[");
+    for (size_t i = 0; i < val.array->len; ++i) {
+      printf(i ? ", %lf" : "%lf", val.array->data[i]);
+    }
+    printf("]\n");
+  }
+}
+
+static Value concat(Value lval, Value rval) {
+  size_t len1 = strlen(lval.str);
+  size_t len2 = strlen(rval.str);
+  char* buf = (char*)calloc(len1 + len2 + 1, sizeof(char));
+  stats_alloc(ALLOC_CONCAT, len1 + len2 + 1);
+  if (!buf) {
+    fprintf(stderr, "メモリ確保に失敗しました。\n");
+    exit(74);
+  }
+  memcpy(buf, lval.str, len1);
+  memcpy(buf + len1, rval.str, len2 + 1);
+  return value_str(buf);
+}
+
+// +。数値同士なら和、文字列同士なら連結
+static Value add_values(Value lval, Value rval) {
+  if (lval.type == VAL_NUM && rval.type == VAL_NUM) {
+    return value_num(lval.num + rval.num);
+  } else if (lval.type == VAL_STRING && rval.type == VAL_STRING) {
+    return concat(lval, rval);
+  }
+  fprintf(stderr, "+は数値同士か、文字列同士以外に使えません。\n");
+  fail(74);
+}
+
+// -, *, / のオペランド
+static void expect_numbers(Value lval, Value rval) {
+  if (lval.type != VAL_NUM || rval.type != VAL_NUM) {
+    fprintf(stderr, "算術演算は数値同士にしか使えません。\n");
+    fail(74);
+  }
+}
+
+// --- 配列と組み込み関数 ---
+// 配列はdoubleを詰めて持ち、一括の演算（sum, min, max, scale, dot, add）は
+// SIMDのカーネルで要素をまとめて処理する。
+
+static Array* array_new(size_t len) {
+  Array* a = (Array*)calloc(1, sizeof(Array));
+  a->cap = len > 8 ? len : 8;
+  a->data = (double*)calloc(a->cap, sizeof(double));
+  if (!a->data) {
+    fprintf(stderr, "メモリ確保に失敗しました。\n");
+    exit(74);
+  }
+  a->len = len;
+  stats_alloc(ALLOC_ARRAY, sizeof(Array) + a->cap * sizeof(double));
+  return a;
+}
+
+static void array_push(Array* a, double x) {
+  if (a->len == a->cap) {
+    a->cap *= 2;
+    a->data = realloc(a->data, a->cap * sizeof(double));
+    if (!a->data) {
+      fprintf(stderr, "メモリ確保に失敗しました。\n");
+      exit(74);
+    }
+    stats_alloc(ALLOC_ARRAY, a->cap * sizeof(double));
+  }
+  a->data[a->len++] = x;
+}
+
+static Array* expect_array(Value v, char* what) {
+  if (v.type != VAL_ARRAY) {
+    fprintf(stderr, "%sには配列が必要です。\n", what);
+    fail(74);
+  }
+  return v.array;
+}
+
+static double expect_number(Value v, char* what) {
+  if (v.type != VAL_NUM) {
+    fprintf(stderr, "%sには数値が必要です。\n", what);
+    fail(74);
+  }
+  return v.num;
+}
+
+static size_t array_index(Array* a, Value index) {
+  double i = expect_number(index, "添字");
+  if (i < 0 || i >= (double)a->len || i != (double)(size_t)i) {
+    fprintf(stderr, "配列の範囲外です: %lf\n", i);
+    fail(74);
+  }
+  return (size_t)i;
+}
+
+// a[i]
+static double array_get(Value obj, Value index) {
+  Array* a = expect_array(obj, "添字の対象");
+  return a->data[array_index(a, index)];
+}
+
+// a[i] = v。値はvのまま
+static Value array_set(Value obj, Value index, Value v) {
+  Array* a = expect_array(obj, "添字の対象");
+  a->data[array_index(a, index)] = expect_number(v, "配列の要素");
+  return v;
+}
+
+// [a, b, ...]
+static Value array_literal(Value* args, int argc) {
+  Array* a = array_new(argc);
+  for (int i = 0; i < argc; ++i) {
+    a->data[i] = expect_number(args[i], "配列の要素");
+  }
+  return value_array(a);
+}
+
+static Value call_native(Value callee, Value* args, int argc) {
+  if (callee.type != VAL_NATIVE) {
+    fprintf(stderr, "呼び出せるのは関数だけです。\n");
+    fail(74);
+  }
+  if (argc != callee.native->arity) {
+    fprintf(stderr, "%s()の引数は%d個です。\n", callee.native->name,
+            callee.native->arity);
+    fail(74);
+  }
+  return callee.native->fn(args, argc);
+}
+
+typedef struct {
+  double (*sum)(const double* a, size_t n);
+  double (*min)(const double* a, size_t n);  // n > 0
+  double (*max)(const double* a, size_t n);  // n > 0
+  void (*scale)(double* dst, const double* a, double k, size_t n);
+  double (*dot)(const double* a, const double* b, size_t n);
+  void (*add)(double* dst, const double* a, const double* b, size_t n);
+} ArrayKernels;
+
+// 和は4本の部分和で取るので、前から順に足した値とは丸めが異なることがある
+static double scalar_array_sum(const double* a, size_t n) {
+  double s[4] = {0, 0, 0, 0};
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    for (int j = 0; j < 4; ++j) s[j] += a[k + j];
+  }
+  for (; k < n; ++k) s[k % 4] += a[k];
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+static double scalar_array_min(const double* a, size_t n) {
+  double m = a[0];
+  for (size_t k = 1; k < n; ++k) m = a[k] < m ? a[k] : m;
+  return m;
+}
+
+static double scalar_array_max(const double* a, size_t n) {
+  double m = a[0];
+  for (size_t k = 1; k < n; ++k) m = a[k] > m ? a[k] : m;
+  return m;
+}
+
+static void scalar_array_scale(double* dst, const double* a, double k, size_t n) {
+  for (size_t j = 0; j < n; ++j) dst[j] = a[j] * k;
+}
+
+static double scalar_array_dot(const double* a, const double* b, size_t n) {
+  double s[4] = {0, 0, 0, 0};
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    for (int j = 0; j < 4; ++j) s[j] += a[k + j] * b[k + j];
+  }
+  for (; k < n; ++k) s[k % 4] += a[k] * b[k];
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+static void scalar_array_add(double* dst, const double* a, const double* b, size_t n) {
+  for (size_t k = 0; k < n; ++k) dst[k] = a[k] + b[k];
+}
+
+#if defined(__x86_64__)
+#define DEFINE_SIMD_ARRAY(ISA, VEC, WIDTH, LOADU, STOREU, ADD, MUL, MIN, MAX, \
+                          SET1, SETZERO)                                      \
+  static double ISA##_array_sum(const double* a, size_t n) {                 \
+    VEC s = SETZERO();                                                       \
+    size_t k = 0;                                                            \
+    for (; k + WIDTH <= n; k += WIDTH) s = ADD(s, LOADU(a + k));             \
+    double lanes[WIDTH];                                                     \
+    STOREU(lanes, s);                                                        \
+    double r = 0;                                                            \
+    for (int j = 0; j < WIDTH; ++j) r += lanes[j];                           \
+    for (; k < n; ++k) r += a[k];                                            \
+    return r;                                                                \
+  }                                                                          \
+                                                                             \
+  static double ISA##_array_min(const double* a, size_t n) {                 \
+    if (n < WIDTH) return scalar_array_min(a, n);                            \
+    VEC m = LOADU(a);                                                        \
+    size_t k = WIDTH;                                                        \
+    for (; k + WIDTH <= n; k += WIDTH) m = MIN(m, LOADU(a + k));             \
+    double lanes[WIDTH];                                                     \
+    STOREU(lanes, m);                                                        \
+    double r = scalar_array_min(lanes, WIDTH);                               \
+    for (; k < n; ++k) r = a[k] < r ? a[k] : r;                              \
+    return r;                                                                \
+  }                                                                          \
+                                                                             \
+  static double ISA##_array_max(const double* a, size_t n) {                 \
+    if (n < WIDTH) return scalar_array_max(a, n);                            \
+    VEC m = LOADU(a);                                                        \
+    size_t k = WIDTH;                                                        \
+    for (; k + WIDTH <= n; k += WIDTH) m = MAX(m, LOADU(a + k));             \
+    double lanes[WIDTH];                                                     \
+    STOREU(lanes, m);                                                        \
+    double r = scalar_array_max(lanes, WIDTH);                               \
+    for (; k < n; ++k) r = a[k] > r ? a[k] : r;                              \
+    return r;                                                                \
+  }                                                                          \
+                                                                             \
+  static void ISA##_array_scale(double* dst, const double* a, double k,      \
+                                size_t n) {                                  \
+    VEC f = SET1(k);                                                         \
+    size_t j = 0;                                                            \
+    for (; j + WIDTH <= n; j += WIDTH) STOREU(dst + j, MUL(LOADU(a + j), f)); \
+    scalar_array_scale(dst + j, a + j, k, n - j);                            \
+  }                                                                          \
+                                                                             \
+  static double ISA##_array_dot(const double* a, const double* b, size_t n) { \
+    VEC s = SETZERO();                                                       \
+    size_t k = 0;                                                            \
+    for (; k + WIDTH <= n; k += WIDTH) {                                     \
+      s = ADD(s, MUL(LOADU(a + k), LOADU(b + k)));                           \
+    }                                                                        \
+    double lanes[WIDTH];                                                     \
+    STOREU(lanes, s);                                                        \
+    double r = 0;                                                            \
+    for (int j = 0; j < WIDTH; ++j) r += lanes[j];                           \
+    for (; k < n; ++k) r += a[k] * b[k];                                     \
+    return r;                                                                \
+  }                                                                          \
+                                                                             \
+  static void ISA##_array_add(double* dst, const double* a, const double* b, \
+                              size_t n) {                                    \
+    size_t k = 0;                                                            \
+    for (; k + WIDTH <= n; k += WIDTH) {                                     \
+      STOREU(dst + k, ADD(LOADU(a + k), LOADU(b + k)));                      \
+    }                                                                        \
+    scalar_array_add(dst + k, a + k, b + k, n - k);                          \
+  }
+
+DEFINE_SIMD_ARRAY(sse2, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd,
+                  _mm_mul_pd, _mm_min_pd, _mm_max_pd, _mm_set1_pd,
+                  _mm_setzero_pd)
+
+#pragma GCC push_options
+#pragma GCC target("avx")
+DEFINE_SIMD_ARRAY(avx, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd,
+                  _mm256_add_pd, _mm256_mul_pd, _mm256_min_pd, _mm256_max_pd,
+                  _mm256_set1_pd, _mm256_setzero_pd)
+#pragma GCC pop_options
+#endif
+
+static ArrayKernels array_kernels = {scalar_array_sum,   scalar_array_min,
+                                     scalar_array_max,   scalar_array_scale,
+                                     scalar_array_dot,   scalar_array_add};
+
+static void array_init() {
+  static bool initialized = false;
+  if (initialized) return;
+  initialized = true;
+
+  if (getenv("ASARI_NO_SIMD")) return;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx")) {
+    array_kernels = (ArrayKernels){avx_array_sum, avx_array_min, avx_array_max,
+                                   avx_array_scale, avx_array_dot, avx_array_add};
+  } else {
+    array_kernels = (ArrayKernels){sse2_array_sum, sse2_array_min, sse2_array_max,
+                                   sse2_array_scale, sse2_array_dot, sse2_array_add};
+  }
+#endif
+}
+
+static Value native_array(Value* args, int argc) {
+  (void)argc;
+  double n = expect_number(args[0], "array()");
+  if (n < 0 || n != (double)(size_t)n) {
+    fprintf(stderr, "array()の長さが不正です: %lf\n", n);
+    fail(74);
+  }
+  return value_array(array_new((size_t)n));
+}
+
+static Value native_len(Value* args, int argc) {
+  (void)argc;
+  if (args[0].type == VAL_STRING) return value_num(strlen(args[0].str));
+  return value_num(expect_array(args[0], "len()")->len);
+}
+
+static Value native_push(Value* args, int argc) {
+  (void)argc;
+  array_push(expect_array(args[0], "push()"), expect_number(args[1], "push()"));
+  return value_nil();
+}
+
+static Value native_sum(Value* args, int argc) {
+  (void)argc;
+  Array* a = expect_array(args[0], "sum()");
+  array_init();
+  return value_num(array_kernels.sum(a->data, a->len));
+}
+
+static Value native_min(Value* args, int argc) {
+  (void)argc;
+  Array* a = expect_array(args[0], "min()");
+  if (a->len == 0) return value_nil();
+  array_init();
+  return value_num(array_kernels.min(a->data, a->len));
+}
+
+static Value native_max(Value* args, int argc) {
+  (void)argc;
+  Array* a = expect_array(args[0], "max()");
+  if (a->len == 0) return value_nil();
+  array_init();
+  return value_num(array_kernels.max(a->data, a->len));
+}
+
+static Value native_scale(Value* args, int argc) {
+  (void)argc;
+  Array* a = expect_array(args[0], "scale()");
+  double k = expect_number(args[1], "scale()");
+  Array* r = array_new(a->len);
+  array_init();
+  array_kernels.scale(r->data, a->data, k, a->len);
+  return value_array(r);
+}
+
+static Value native_dot(Value* args, int argc) {
+  (void)argc;
+  Array* a = expect_array(args[0], "dot()");
+  Array* b = expect_array(args[1], "dot()");
+  if (a->len != b->len) {
+    fprintf(stderr, "dot()の配列の長さが違います。\n");
+    fail(74);
+  }
+  array_init();
+  return value_num(array_kernels.dot(a->data, b->data, a->len));
+}
+
+static Value native_add(Value* args, int argc) {
+  (void)argc;
+  Array* a = expect_array(args[0], "add()");
+  Array* b = expect_array(args[1], "add()");
+  if (a->len != b->len) {
+    fprintf(stderr, "add()の配列の長さが違います。\n");
+    fail(74);
+  }
+  Array* r = array_new(a->len);
+  array_init();
+  array_kernels.add(r->data, a->data, b->data, a->len);
+  return value_array(r);
+}
+
+static Value native_clock(Value* args, int argc) {
+  (void)args;
+  (void)argc;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return value_num(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static Value native_sqrt(Value* args, int argc) {
+  (void)argc;
+  return value_num(sqrt(expect_number(args[0], "sqrt()")));
+}
+
+static Value native_floor(Value* args, int argc) {
+  (void)argc;
+  return value_num(floor(expect_number(args[0], "floor()")));
+}
+
+static Value native_abs(Value* args, int argc) {
+  (void)argc;
+  return value_num(fabs(expect_number(args[0], "abs()")));
+}
+
+static Native natives[] = {
+    {"clock", 0, native_clock}, {"sqrt", 1, native_sqrt},
+    {"floor", 1, native_floor}, {"abs", 1, native_abs},
+    {"array", 1, native_array}, {"len", 1, native_len},
+    {"push", 2, native_push},   {"sum", 1, native_sum},
+    {"min", 1, native_min},     {"max", 1, native_max},
+    {"scale", 2, native_scale}, {"dot", 2, native_dot},
+    {"add", 2, native_add},     {"readLine", 0, native_readLine},
+};
+
+#endif
@@ -4,7 +4,7 @@ assert() {
     input=$1
     expected=$2
 
-    actual=$(./asari-lox "$input")
+    actual=$(./asari-lox "$input" < /dev/null)
 
     if [ "$actual" = "$expected" ]; then
         echo "$input => $expected"
@@ -14,6 +14,115 @@ assert() {
     fi
 }
 
+# オプション付きで実行し、標準出力を比べる
+assert_run() {
+    expected=$1
+    shift
+
+    actual=$(./asari-lox "$@" < /dev/null)
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$* => $expected"
+    else
+        echo "$* => $expected but, got $actual"
+        exit 1
+    fi
+}
+
+# オプション付きで実行し、標準エラーを比べる
+assert_stderr() {
+    expected=$1
+    shift
+
+    actual=$(./asari-lox "$@" 2>&1 > /dev/null < /dev/null)
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$* => $expected"
+    else
+        echo "$* => $expected but, got $actual"
+        exit 1
+    fi
+}
+
+# オプションを付けても、付けないときと標準出力・標準エラー・終了コードが同じか比べる
+assert_same() {
+    input=$1
+    shift
+
+    expected=$(./asari-lox "$input" 2>&1 < /dev/null; echo "exit $?")
+    actual=$(./asari-lox "$@" "$input" 2>&1 < /dev/null; echo "exit $?")
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$* $input => same"
+    else
+        echo "$* $input => differs"
+        diff <(echo "$expected") <(echo "$actual")
+        exit 1
+    fi
+}
+
+# 環境変数を付けても、付けないときと標準出力・標準エラー・終了コードが同じか比べる
+assert_same_env() {
+    input=$1
+    shift
+
+    expected=$(./asari-lox "$input" 2>&1 < /dev/null; echo "exit $?")
+    actual=$(env "$@" ./asari-lox "$input" 2>&1 < /dev/null; echo "exit $?")
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$* $input => same"
+    else
+        echo "$* $input => differs"
+        diff <(echo "$expected") <(echo "$actual")
+        exit 1
+    fi
+}
+
+# オプション付きで実行し、終了コードを比べる
+assert_status() {
+    expected=$1
+    shift
+
+    ./asari-lox "$@" > /dev/null 2>&1 < /dev/null
+    actual=$?
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$* => exit $expected"
+    else
+        echo "$* => exit $expected but, got exit $actual"
+        exit 1
+    fi
+}
+
+# --emit-cで変換したCをコンパイルして実行し、インタプリタと標準出力・標準エラー・
+# 終了コードが同じか比べる。変換で止まったときは、そのエラーと終了コードを比べる
+assert_emit_c() {
+    input=$1
+    dir=$(mktemp -d)
+
+    expected=$(./asari-lox "$input" 2>&1 < /dev/null; echo "exit $?")
+    ./asari-lox --emit-c "$dir/out.c" "$input" > "$dir/emit.log" 2>&1
+    status=$?
+    if [ $status -ne 0 ]; then
+        actual=$(cat "$dir/emit.log"; echo "exit $status")
+    elif ! gcc -std=c11 -O2 -Wall -Wextra -Werror "$dir/out.c" -lm -o "$dir/out"; then
+        echo "--emit-c $input => gcc failed"
+        rm -rf "$dir"
+        exit 1
+    else
+        actual=$("$dir/out" 2>&1 < /dev/null; echo "exit $?")
+    fi
+    rm -rf "$dir"
+
+    if [ "$actual" = "$expected" ]; then
+        echo "--emit-c $input => same"
+    else
+        echo "--emit-c $input => differs"
+        diff <(echo "$expected") <(echo "$actual")
+        exit 1
+    fi
+}
+
 # assert "" ""
 # assert "(){}" "(){}"
 # assert "!=" "!="
@@ -32,7 +141,118 @@ assert() {
 # assert "   and " "and"
 # assert "   fun " "fun"
 
-assert "test/a.lox" "var a = 100 ;"
-assert "test/b.lox" "if ( true ) { } else { }"
+assert "test/a.lox" ""
+assert "test/b.lox" ""
+
+# --lazy: 実行しない分岐の構文エラーは報告しないが、--checkでは見つける
+assert_run "1.000000" --lazy test/lazy.lox
+assert_status 65 --check test/lazy.lox
+assert_status 65 test/lazy.lox
+
+# 比較は左辺から評価する。--single-passも木と同じ順
+assert "test/compare.lox" "$(printf 'false\ntrue\nfalse\ntrue\nfalse\nfalse\n45.000000')"
+for f in test/*.lox; do
+    assert_same "$f" --single-pass
+done
+
+# 共有された部分式（ハッシュコンス）があっても、最適化やプロファイルで出力は変わらない
+assert_same test/repeat.lox --no-opt
+profile=$(mktemp)
+./asari-lox --write-profile "$profile" test/repeat.lox > /dev/null
+assert_same test/repeat.lox --use-profile "$profile"
+rm -f "$profile"
+
+# --green: 組み込み関数への代入はそのタスクの中だけ
+assert_run "$(printf '2.000000\nnil\n2.000000\nnil')" --green test/clobber.lox test/clobber.lox
+
+# 読まれない宣言と、上書きされる代入を消す。副作用のある右辺は式文として残し、
+# ベクトル化したループの本体は触らない
+assert_same test/dead.lox --no-opt
+assert_stderr "$(printf '%s\n' '--- dead code ---' \
+    'line 2: removed declaration of unused (unused)' \
+    'line 3: removed declaration of line (unused, expression kept)' \
+    'line 5: removed declaration of pushed (unused, expression kept)' \
+    'line 8: removed store of x (overwritten)' \
+    'line 13: removed store of y (overwritten, expression kept)' \
+    'line 19: removed declaration of s (unused)' \
+    'line 20: removed store of s (unused)' \
+    'line 26: removed declaration of never (unused)')" --dump-dead test/dead.lox
+
+# REPLと--snapshot-outでは、トップレベルの変数は後から読まれるので消さない
+actual=$(printf 'var kept = 1;\nprint kept;\n' | ./asari-lox)
+if [ "$actual" = "$(printf '> > 1.000000\n> ')" ]; then
+    echo "REPL var kept => 1.000000"
+else
+    echo "REPL var kept => 1.000000 but, got $actual"
+    exit 1
+fi
+snapshot=$(mktemp)
+./asari-lox --snapshot-out "$snapshot" test/globals.lox
+actual=$(echo 'print greeting; print answer;' | ./asari-lox --snapshot-in "$snapshot")
+rm -f "$snapshot"
+if [ "$actual" = "$(printf '> hello\n42.000000\n> ')" ]; then
+    echo "--snapshot-out test/globals.lox => hello 42.000000"
+else
+    echo "--snapshot-out test/globals.lox => hello 42.000000 but, got $actual"
+    exit 1
+fi
+
+# ベクトル化した総和ループは、元のループやSIMDなしと同じ結果。外側のループで
+# 入り直すたびに上限を計算し直す
+assert "test/reduce.lox" "$(printf '999000.000000\n505.000000\n15.000000\n45.000000\n91.000000\n5.000000')"
+assert_same test/reduce.lox --no-opt
+assert_same_env test/reduce.lox ASARI_NO_SIMD=1
+
+# 配列と一括演算。SIMDのカーネルとスカラーの版で結果が同じ
+assert_same_env test/array.lox ASARI_NO_SIMD=1
+assert "test/array.lox" "$(cat <<'END'
+[3.000000, 1.000000, 4.000000, 1.000000, 5.000000, 9.000000, 2.000000, 6.000000, 5.000000, 3.000000]
+10.000000
+5.000000
+7.000000
+[0.000000, 0.500000, 1.000000, 1.500000, 2.000000, 2.500000, 3.000000, 3.500000, 4.000000, 7.000000]
+39.000000
+0.000000
+106.500000
+1.000000
+9.000000
+-7.000000
+2.000000
+nil
+[1.500000, 0.500000, 2.000000, 0.500000, 2.500000, 4.500000, 1.000000, 3.000000, 2.500000, 1.500000]
+[3.000000, 1.500000, 5.000000, 2.500000, 7.000000, 11.500000, 5.000000, 9.500000, 9.000000, 10.000000]
+2584444.428571
+9008620843.775509
+-71.428571
+5224.857143
+7753333.285714
+5168888.857143
+true
+false
+<native fn sum>
+END
+)"
+for f in test/array_range.lox test/array_type.lox test/array_dot.lox test/array_elem.lox; do
+    assert_status 74 "$f"
+    assert_same_env "$f" ASARI_NO_SIMD=1
+done
+
+# 1MBのブロックをまたぐ長い行。使わなくなったブロックは解放するが、変数と式の途中の
+# 行が指すブロックは残す
+long_line=$(head -c 700000 /dev/zero | tr '\0' 7)
+actual=$(for i in 1 2 3 4 5 6 7 8 9; do printf '%s\n' "$long_line"; done | ./asari-lox test/lines.lox)
+expected=$(printf 'true\ntrue\ntrue\ntrue\nfalse\n10.000000\n700000.000000')
+if [ "$actual" = "$expected" ]; then
+    echo "test/lines.lox < long lines => same"
+else
+    echo "test/lines.lox < long lines => differs"
+    diff <(echo "$expected") <(echo "$actual")
+    exit 1
+fi
+
+# 変換したCは、インタプリタと同じランタイム（asari-runtime.h）で動く
+for f in test/*.lox; do
+    assert_emit_c "$f"
+done
 
 echo "Ok"
\ No newline at end of file